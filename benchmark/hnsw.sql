@@ -0,0 +1,66 @@
+-- Measures the recall and the latency of spectrum_hnsw index scans compared to exact searches.
+--
+-- usage: psql -v table=spectrums -v column=spectrum -v queries=100 -v k=20 -f benchmark/hnsw.sql
+--
+-- The table has to be indexed by the spectrum_hnsw index. Query spectrums are sampled from the table itself, the exact
+-- results are computed by sequential scans. The recall is the fraction of the exact k nearest spectrums returned
+-- by the index scan.
+
+\set ON_ERROR_STOP on
+
+
+create function pg_temp.hnsw_benchmark(tab regclass, col name, queries int, k int, ef_values int[])
+returns table(ef_search int, recall float8, exact_ms float8, hnsw_ms float8) as
+$$
+declare
+    query_spectrums pgms.spectrum[];
+    search text;
+    start timestamptz;
+    exact tid[];
+    result tid[];
+    hits int;
+    recalls float8[] := array_fill(0::float8, array[cardinality(ef_values)]);
+    times float8[] := array_fill(0::float8, array[cardinality(ef_values)]);
+    exact_time float8 := 0;
+begin
+    execute format('select array_agg(%I) from (select %I from %s order by random() limit $1) q', col, col, tab)
+        into query_spectrums using queries;
+
+    search := format('select array_agg(ctid) from (select ctid from %s order by %I operator(pgms.<->) $1 limit $2) r',
+        tab, col);
+
+    for q in 1 .. cardinality(query_spectrums) loop
+        perform set_config('enable_indexscan', 'off', true);
+        perform set_config('enable_seqscan', 'on', true);
+
+        start := clock_timestamp();
+        execute search into exact using query_spectrums[q], k;
+        exact_time := exact_time + extract(epoch from clock_timestamp() - start) * 1000;
+
+        perform set_config('enable_indexscan', 'on', true);
+        perform set_config('enable_seqscan', 'off', true);
+
+        for e in 1 .. cardinality(ef_values) loop
+            perform set_config('pgms.hnsw_ef_search', ef_values[e]::text, true);
+
+            start := clock_timestamp();
+            execute search into result using query_spectrums[q], k;
+            times[e] := times[e] + extract(epoch from clock_timestamp() - start) * 1000;
+
+            select count(*) into hits from unnest(result) r where r = any(exact);
+            recalls[e] := recalls[e] + hits::float8 / greatest(cardinality(exact), 1);
+        end loop;
+    end loop;
+
+    for e in 1 .. cardinality(ef_values) loop
+        ef_search := ef_values[e];
+        recall := recalls[e] / cardinality(query_spectrums);
+        exact_ms := exact_time / cardinality(query_spectrums);
+        hnsw_ms := times[e] / cardinality(query_spectrums);
+        return next;
+    end loop;
+end
+$$ language plpgsql;
+
+
+select * from pg_temp.hnsw_benchmark(:'table', :'column', :queries, :k, array[10, 20, 40, 80, 160, 320]);
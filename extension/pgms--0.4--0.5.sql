@@ -0,0 +1,172 @@
+-- complain if script is sourced in psql, rather than via CREATE EXTENSION
+\echo Use "CREATE EXTENSION pgms" to load this file. \quit
+
+
+CREATE FUNCTION spectrum_recv(internal) RETURNS spectrum AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_send(spectrum) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+ALTER TYPE spectrum SET (RECEIVE = spectrum_recv, SEND = spectrum_send);
+
+CREATE FUNCTION spectrum_typanalyze(internal) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+ALTER TYPE spectrum SET (ANALYZE = spectrum_typanalyze);
+
+CREATE FUNCTION spectrum_compact(spectrum) RETURNS spectrum   AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_expand(spectrum) RETURNS spectrum    AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+CREATE FUNCTION spectrum_hash(spectrum) RETURNS int4 AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_hash_extended(spectrum, int8) RETURNS int8 AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+
+CREATE OPERATOR CLASS spectrum DEFAULT FOR TYPE spectrum USING hash AS
+    OPERATOR   1   =,
+    FUNCTION   1   spectrum_hash,
+    FUNCTION   2   spectrum_hash_extended;
+
+CREATE FUNCTION spectrum_sortsupport(internal) RETURNS void AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+ALTER OPERATOR FAMILY spectrum USING btree ADD FUNCTION 2 (spectrum, spectrum) spectrum_sortsupport(internal);
+
+CREATE FUNCTION spectrum_peak_count(spectrum) RETURNS int4   AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_min_mz(spectrum) RETURNS float4       AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_max_mz(spectrum) RETURNS float4       AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+
+CREATE FUNCTION spectrum_similarity_support(internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_similarity_sel(internal, oid, internal, integer) RETURNS float8 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+ALTER FUNCTION cosine_greedy(spectrum, spectrum, float4) SUPPORT spectrum_similarity_support;
+ALTER FUNCTION cosine_greedy(spectrum, spectrum, float4, float4, float4) SUPPORT spectrum_similarity_support;
+ALTER FUNCTION cosine_hungarian(spectrum, spectrum, float4, float4, float4) SUPPORT spectrum_similarity_support;
+ALTER FUNCTION cosine_modified(spectrum, spectrum, float4, float4, float4, float4) SUPPORT spectrum_similarity_support;
+ALTER FUNCTION intersect_mz(spectrum, spectrum, float4) SUPPORT spectrum_similarity_support;
+
+CREATE FUNCTION cosine_greedy_above(spectrum, spectrum, float4, float4) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 100 SUPPORT spectrum_similarity_support;
+CREATE FUNCTION cosine_hungarian_above(spectrum, spectrum, float4, float4) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+CREATE FUNCTION cosine_modified_above(spectrum, spectrum, float4, float4, float4) RETURNS bool AS 'MODULE_PATHNAME', 'modified_cosine_above' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+
+CREATE FUNCTION spectrum_similar(spectrum,spectrum) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 100 SUPPORT spectrum_similarity_support;
+
+CREATE OPERATOR % (
+    leftarg = spectrum,
+    rightarg = spectrum,
+    procedure = spectrum_similar,
+    restrict = spectrum_similarity_sel,
+    join = contjoinsel
+);
+
+CREATE FUNCTION spectrum_gist_consistent(internal, spectrum, smallint, oid, internal) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_union(internal, internal) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_compress(internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_decompress(internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_penalty(internal, internal, internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_picksplit(internal, internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gist_same(bytea, bytea, internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+CREATE OPERATOR CLASS spectrum_gist_ops FOR TYPE spectrum USING gist AS
+    OPERATOR   1   %,
+    FUNCTION   1   spectrum_gist_consistent(internal, spectrum, smallint, oid, internal),
+    FUNCTION   2   spectrum_gist_union(internal, internal),
+    FUNCTION   3   spectrum_gist_compress(internal),
+    FUNCTION   4   spectrum_gist_decompress(internal),
+    FUNCTION   5   spectrum_gist_penalty(internal, internal, internal),
+    FUNCTION   6   spectrum_gist_picksplit(internal, internal),
+    FUNCTION   7   spectrum_gist_same(bytea, bytea, internal),
+    STORAGE    bytea;
+
+
+CREATE FUNCTION spectrum_overlaps(spectrum,spectrum) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 100 SUPPORT spectrum_similarity_support;
+
+CREATE OPERATOR && (
+    leftarg = spectrum,
+    rightarg = spectrum,
+    procedure = spectrum_overlaps,
+    restrict = spectrum_similarity_sel,
+    join = contjoinsel
+);
+
+CREATE FUNCTION spectrum_gin_extract_value(spectrum, internal, internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gin_extract_query(spectrum, internal, int2, internal, internal, internal, internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION spectrum_gin_consistent(internal, int2, spectrum, int4, internal, internal, internal, internal) RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+CREATE OPERATOR CLASS spectrum_gin_ops FOR TYPE spectrum USING gin AS
+    OPERATOR   1   %,
+    OPERATOR   2   &&,
+    FUNCTION   1   btint4cmp(int4, int4),
+    FUNCTION   2   spectrum_gin_extract_value(spectrum, internal, internal),
+    FUNCTION   3   spectrum_gin_extract_query(spectrum, internal, int2, internal, internal, internal, internal),
+    FUNCTION   4   spectrum_gin_consistent(internal, int2, spectrum, int4, internal, internal, internal, internal),
+    STORAGE    int4;
+
+
+CREATE FUNCTION spectrum_distance(spectrum,spectrum) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 100 SUPPORT spectrum_similarity_support;
+
+CREATE OPERATOR <-> (
+    leftarg = spectrum,
+    rightarg = spectrum,
+    procedure = spectrum_distance
+);
+
+CREATE FUNCTION spectrum_hnsw_handler(internal) RETURNS index_am_handler AS 'MODULE_PATHNAME' LANGUAGE C;
+
+CREATE ACCESS METHOD spectrum_hnsw TYPE INDEX HANDLER spectrum_hnsw_handler;
+
+CREATE OPERATOR CLASS spectrum_hnsw_ops DEFAULT FOR TYPE spectrum USING spectrum_hnsw AS
+    OPERATOR   1   <-> (spectrum, spectrum) FOR ORDER BY float_ops;
+
+
+CREATE FUNCTION precurzor_mz_lower(float4, float4, tolerance) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION precurzor_mz_upper(float4, float4, tolerance) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION precurzor_mz_support(internal) RETURNS internal AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION precurzor_mz_within(float4, float4, float4=1.0, tolerance='DALTON') RETURNS bool AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT precurzor_mz_support;
+
+
+CREATE TYPE similarity_method AS ENUM ('COSINE_GREEDY', 'COSINE_HUNGARIAN');
+
+CREATE FUNCTION batch_search(spectrum[], regclass, name, similarity_method='COSINE_GREEDY', float4=0.1, float4=0.7) RETURNS TABLE(query_idx int4, ctid tid, score float4) AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+
+CREATE TYPE similarity_scores AS (cosine_greedy float4, cosine_hungarian float4, cosine_modified float4, intersect_mz float4, matches int4);
+
+CREATE FUNCTION similarity(spectrum, spectrum, float4=0.0, float4=0.1, float4=0.0, float4=1.0, int4=0) RETURNS similarity_scores AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+
+
+CREATE FUNCTION entropy_similarity(spectrum, spectrum, float4=0.1, bool=true) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+CREATE FUNCTION spectrum_entropy(spectrum) RETURNS float4      AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+
+CREATE FUNCTION cosine_modified_hungarian(spectrum, spectrum, float4, float4=0.1, float4=0.0, float4=1.0) RETURNS float4 AS 'MODULE_PATHNAME', 'modified_cosine_hungarian' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+
+
+CREATE FUNCTION cosine_greedy_matchms(spectrum, spectrum, float4=0.1, float4=0.0, float4=1.0) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
+
+
+CREATE TYPE binned_spectrum;
+
+CREATE FUNCTION binned_spectrum_input(cstring) RETURNS binned_spectrum  AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION binned_spectrum_output(binned_spectrum) RETURNS cstring AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION binned_spectrum_recv(internal) RETURNS binned_spectrum AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION binned_spectrum_send(binned_spectrum) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C STABLE PARALLEL SAFE STRICT;
+
+CREATE TYPE binned_spectrum
+(
+    internallength = VARIABLE,
+    input = binned_spectrum_input,
+    output = binned_spectrum_output,
+    receive = binned_spectrum_recv,
+    send = binned_spectrum_send,
+    alignment = int4,
+    storage = extended
+);
+
+CREATE FUNCTION spectrum_to_binned(spectrum, float4, float4, float4=0.0, float4=1.0) RETURNS binned_spectrum AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION binned_cosine(binned_spectrum, binned_spectrum) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+
+CREATE FUNCTION spectrum_sketch(spectrum, int4, float4) RETURNS int4[] AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION sketch_bands(int4[], int4) RETURNS int8[] AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION sketch_intersect_mz(int4[], int4[]) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+CREATE FUNCTION sketch_cosine_greedy(int4[], int4[]) RETURNS float4 AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE PARALLEL SAFE STRICT;
+
+
+CREATE FUNCTION entropy_similarity(spectrum, spectrum, float4, bool, float4, float4) RETURNS float4 AS 'MODULE_PATHNAME', 'entropy_similarity_entropies' LANGUAGE C STABLE PARALLEL SAFE STRICT COST 1000 SUPPORT spectrum_similarity_support;
@@ -0,0 +1,395 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <common/shortest_dec.h>
+#include <libpq/pqformat.h>
+#include <utils/builtins.h>
+#include "binned.h"
+#include "simd.h"
+#include "similarity/cosine.h"
+#include "similarity/scratch.h"
+
+
+static BinnedSpectrum *allocate_binned(int dim, int nnz)
+{
+    BinnedSpectrum *result = palloc0(BINNED_SIZE(nnz));
+    SET_VARSIZE(result, BINNED_SIZE(nnz));
+    result->dim = dim;
+    result->nnz = nnz;
+
+    return result;
+}
+
+
+static void check_binned_dim(int64 dim)
+{
+    if(dim < 1)
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("binned spectrum must have at least 1 dimension")));
+
+    if(dim > BINNED_MAX_DIM)
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("binned spectrum cannot have more than %d dimensions", BINNED_MAX_DIM)));
+}
+
+
+static void check_binned_nnz(int64 nnz, int dim)
+{
+    if(nnz < 0 || nnz > dim)
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("invalid number of nonzero elements of binned spectrum")));
+
+    if(nnz > BINNED_MAX_NNZ)
+        ereport(ERROR, (errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED), errmsg("binned spectrum cannot have more than %d nonzero elements", BINNED_MAX_NNZ)));
+}
+
+
+static void skip_blank(char **data)
+{
+    while(**data != '\0' && isspace((unsigned char) **data))
+        (*data)++;
+}
+
+
+static int64 read_integer(char **data)
+{
+    skip_blank(data);
+
+    char *num = *data;
+    errno = 0;
+
+    long long val = strtoll(num, data, 10);
+
+    if(*data == num || errno != 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    return val;
+}
+
+
+static float4 read_float(char **data)
+{
+    skip_blank(data);
+
+    char *num = *data;
+    errno = 0;
+
+    float4 val = strtof(num, data);
+
+    if(*data == num || errno != 0 || !isfinite(val))
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    return val;
+}
+
+
+/*
+ * Reads the binned spectrum in the text format of sparsevec, e.g. '{1:0.6,3:0.8}/5', zero values are omitted.
+ */
+PG_FUNCTION_INFO_V1(binned_spectrum_input);
+Datum binned_spectrum_input(PG_FUNCTION_ARGS)
+{
+    char *data = PG_GETARG_CSTRING(0);
+
+    skip_blank(&data);
+
+    if(*data++ != '{')
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    size_t count = 0;
+
+    for(char *c = data; *c != '\0'; c++)
+        if(*c == ':')
+            count++;
+
+    int32 *indices = palloc(Max(count, 1) * sizeof(int32));
+    float4 *values = palloc(Max(count, 1) * sizeof(float4));
+    int nnz = 0;
+    int64 last = -1;
+
+    skip_blank(&data);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        if(i > 0)
+        {
+            skip_blank(&data);
+
+            if(*data++ != ',')
+                ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+        }
+
+        int64 index = read_integer(&data) - 1;
+        skip_blank(&data);
+
+        if(*data++ != ':')
+            ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+        float4 value = read_float(&data);
+
+        if(index <= last || index >= BINNED_MAX_DIM)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("indices of binned spectrum must be positive, sorted and unique")));
+
+        last = index;
+
+        if(value != 0)
+        {
+            indices[nnz] = index;
+            values[nnz] = value;
+            nnz++;
+        }
+    }
+
+    skip_blank(&data);
+
+    if(*data++ != '}')
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    skip_blank(&data);
+
+    if(*data++ != '/')
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    int64 dim = read_integer(&data);
+    skip_blank(&data);
+
+    if(*data != '\0')
+        ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION), errmsg("malformed binned spectrum literal")));
+
+    check_binned_dim(dim);
+    check_binned_nnz(nnz, dim);
+
+    if(nnz > 0 && indices[nnz - 1] >= dim)
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("index of binned spectrum exceeds its dimension")));
+
+    BinnedSpectrum *result = allocate_binned(dim, nnz);
+    memcpy(result->indices, indices, nnz * sizeof(int32));
+    memcpy(BINNED_VALUES(result), values, nnz * sizeof(float4));
+
+    PG_RETURN_POINTER(result);
+}
+
+
+PG_FUNCTION_INFO_V1(binned_spectrum_output);
+Datum binned_spectrum_output(PG_FUNCTION_ARGS)
+{
+    BinnedSpectrum *binned = PG_GETARG_BINNED_SPECTRUM(0);
+    float4 *values = BINNED_VALUES(binned);
+
+    StringInfoData buffer;
+    initStringInfo(&buffer);
+    appendStringInfoChar(&buffer, '{');
+
+    for(int i = 0; i < binned->nnz; i++)
+    {
+        char value[FLOAT_SHORTEST_DECIMAL_LEN];
+        float_to_shortest_decimal_buf(values[i], value);
+
+        appendStringInfo(&buffer, i > 0 ? ",%d:%s" : "%d:%s", binned->indices[i] + 1, value);
+    }
+
+    appendStringInfo(&buffer, "}/%d", binned->dim);
+
+    PG_FREE_IF_COPY(binned, 0);
+    PG_RETURN_CSTRING(buffer.data);
+}
+
+
+PG_FUNCTION_INFO_V1(binned_spectrum_send);
+Datum binned_spectrum_send(PG_FUNCTION_ARGS)
+{
+    BinnedSpectrum *binned = PG_GETARG_BINNED_SPECTRUM(0);
+    float4 *values = BINNED_VALUES(binned);
+
+    StringInfoData buffer;
+    pq_begintypsend(&buffer);
+    enlargeStringInfo(&buffer, 3 * sizeof(int32) + binned->nnz * (sizeof(int32) + sizeof(float4)));
+
+    pq_sendint32(&buffer, binned->dim);
+    pq_sendint32(&buffer, binned->nnz);
+    pq_sendint32(&buffer, binned->unused);
+
+    for(int i = 0; i < binned->nnz; i++)
+        pq_sendint32(&buffer, binned->indices[i]);
+
+    for(int i = 0; i < binned->nnz; i++)
+        pq_sendfloat4(&buffer, values[i]);
+
+    PG_FREE_IF_COPY(binned, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buffer));
+}
+
+
+PG_FUNCTION_INFO_V1(binned_spectrum_recv);
+Datum binned_spectrum_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buffer = (StringInfo) PG_GETARG_POINTER(0);
+
+    int32 dim = (int32) pq_getmsgint(buffer, sizeof(int32));
+    int32 nnz = (int32) pq_getmsgint(buffer, sizeof(int32));
+    int32 unused = (int32) pq_getmsgint(buffer, sizeof(int32));
+
+    check_binned_dim(dim);
+    check_binned_nnz(nnz, dim);
+
+    if(unused != 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("expected unused to be 0, not %d", unused)));
+
+    BinnedSpectrum *result = allocate_binned(dim, nnz);
+    float4 *values = BINNED_VALUES(result);
+
+    for(int i = 0; i < nnz; i++)
+    {
+        result->indices[i] = (int32) pq_getmsgint(buffer, sizeof(int32));
+
+        if(result->indices[i] < 0 || result->indices[i] >= dim || (i > 0 && result->indices[i] <= result->indices[i - 1]))
+            ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("indices of external binned spectrum value are not sorted or out of range")));
+    }
+
+    for(int i = 0; i < nnz; i++)
+    {
+        values[i] = pq_getmsgfloat4(buffer);
+
+        if(!isfinite(values[i]) || values[i] == 0)
+            ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("external binned spectrum value contains a zero or not finite element")));
+    }
+
+    PG_RETURN_POINTER(result);
+}
+
+
+/*
+ * Sums the weights of peaks over bins of the given width starting at zero, peaks outside of <0, max_mz) are ignored.
+ * The resulting vector is normalized to the unit length, so the dot product of two binned spectra is their binned
+ * cosine score.
+ */
+PG_FUNCTION_INFO_V1(spectrum_to_binned);
+Datum spectrum_to_binned(PG_FUNCTION_ARGS)
+{
+    float4 bin_width = PG_GETARG_FLOAT4(1);
+    float4 max_mz = PG_GETARG_FLOAT4(2);
+    float4 mz_power = PG_GETARG_FLOAT4(3);
+    float4 intensity_power = PG_GETARG_FLOAT4(4);
+
+    if(!isfinite(bin_width) || bin_width <= 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("bin width must be a positive number")));
+
+    if(!isfinite(max_mz) || max_mz <= 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("maximal m/z value must be a positive number")));
+
+    double bins = ceil((double) max_mz / bin_width);
+    check_binned_dim(Min(bins, (double) BINNED_MAX_DIM + 1));
+    int dim = bins;
+
+    scratch_begin();
+
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    WeightedSpectrum spectrum;
+    weighted_spectrum_open(&spectrum, value, power_kind(intensity_power, mz_power), intensity_power, mz_power, NULL);
+
+    int count = spectrum.spectrum.count;
+    int32 *indices = scratch_alloc(Max(count, 1) * sizeof(int32));
+    float4 *values = scratch_alloc(Max(count, 1) * sizeof(float4));
+    int nnz = 0;
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum.spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        if(!(cursor.mz >= 0 && cursor.mz < max_mz))
+            continue;
+
+        int32 bin = Min(floor((double) cursor.mz / bin_width), dim - 1);
+
+        if(nnz == 0 || indices[nnz - 1] != bin)
+        {
+            indices[nnz] = bin;
+            values[nnz] = 0;
+            nnz++;
+        }
+
+        values[nnz - 1] += spectrum_weight(&spectrum, cursor.index);
+    }
+
+    float4 norm = sqrtf(simd.sum_squares(values, nnz));
+
+    if(!isfinite(norm))
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("binned spectrum contains not finite elements")));
+
+    int kept = 0;
+
+    for(int i = 0; i < nnz; i++)
+    {
+        if(values[i] == 0)
+            continue;
+
+        indices[kept] = indices[i];
+        values[kept] = values[i] / norm;
+        kept++;
+    }
+
+    check_binned_nnz(kept, dim);
+
+    BinnedSpectrum *result = allocate_binned(dim, kept);
+    memcpy(result->indices, indices, kept * sizeof(int32));
+    memcpy(BINNED_VALUES(result), values, kept * sizeof(float4));
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_POINTER(result);
+}
+
+
+/*
+ * Computes the cosine score of binned spectra by the sparse dot product kernel. The vectors produced by
+ * spectrum_to_binned() are already normalized, but the norms are computed anyway for the values from other sources.
+ */
+PG_FUNCTION_INFO_V1(binned_cosine);
+Datum binned_cosine(PG_FUNCTION_ARGS)
+{
+    BinnedSpectrum *binned1 = PG_GETARG_BINNED_SPECTRUM(0);
+    BinnedSpectrum *binned2 = PG_GETARG_BINNED_SPECTRUM(1);
+
+    if(binned1->dim != binned2->dim)
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("different binned spectrum dimensions %d and %d", binned1->dim, binned2->dim)));
+
+    float4 *values1 = BINNED_VALUES(binned1);
+    float4 *values2 = BINNED_VALUES(binned2);
+
+    float4 score = simd.sparse_dot(binned1->indices, values1, binned1->nnz, binned2->indices, values2, binned2->nnz);
+    float4 norm = sqrtf(simd.sum_squares(values1, binned1->nnz) * simd.sum_squares(values2, binned2->nnz));
+
+    if(score != 0)
+        score /= norm;
+
+    PG_FREE_IF_COPY(binned1, 0);
+    PG_FREE_IF_COPY(binned2, 1);
+
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
+
+    PG_RETURN_FLOAT4(score);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_BINNED_H_
+#define SRC_BINNED_H_
+
+#include <postgres.h>
+
+
+/*
+ * Binned spectrum is a sparse vector of the weights of peaks summed over m/z bins of a fixed width. Its layout and its
+ * text and binary formats are the same as the ones of the sparsevec type of pgvector, i.e. the indices of nonzero
+ * elements followed by their values, where the indices are zero-based, sorted and unique (the text format uses
+ * one-based indices). The value can be therefore passed to pgvector by a binary coercible cast.
+ */
+#define BINNED_MAX_DIM      1000000000
+#define BINNED_MAX_NNZ      16000
+
+
+typedef struct
+{
+    int32 vl_len_;
+    int32 dim;
+    int32 nnz;
+    int32 unused;
+    int32 indices[FLEXIBLE_ARRAY_MEMBER];
+}
+BinnedSpectrum;
+
+
+#define BINNED_SIZE(nnz)        (offsetof(BinnedSpectrum, indices) + (nnz) * (sizeof(int32) + sizeof(float4)))
+#define BINNED_VALUES(binned)   ((float4 *) ((binned)->indices + (binned)->nnz))
+
+#define DatumGetBinnedSpectrum(x)       ((BinnedSpectrum *) PG_DETOAST_DATUM(x))
+#define PG_GETARG_BINNED_SPECTRUM(x)    DatumGetBinnedSpectrum(PG_GETARG_DATUM(x))
+
+#endif /* SRC_BINNED_H_ */
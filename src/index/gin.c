@@ -0,0 +1,270 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <access/gin.h>
+#include "pgms.h"
+#include "spectrum.h"
+
+
+#define SIMILARITY_STRATEGY     1
+#define OVERLAP_STRATEGY        2
+
+/*
+ * Keys of the index are m/z bins of BIN_WIDTH Daltons, i.e. the default tolerance. A query peak is expanded to all
+ * bins covering its tolerance window. Queries with windows wider than MAX_WINDOW_BINS bins are not selective enough,
+ * so they are evaluated as full index scans.
+ */
+#define BIN_WIDTH               0.1
+#define MAX_WINDOW_BINS         64
+
+
+/*
+ * The keys of a query peak always form a continuous range of the sorted query keys.
+ */
+typedef struct
+{
+    int count;
+    int *first;
+    int *last;
+}
+QueryPeaks;
+
+
+/*
+ * Returns the bin of the m/z value, infinite values are clamped to the outermost bins. The m/z value must not be NaN.
+ */
+static inline int32 mz_bin(float4 mz)
+{
+    double bin = floor(mz / BIN_WIDTH);
+
+    if(bin < PG_INT32_MIN)
+        return PG_INT32_MIN;
+    else if(bin > PG_INT32_MAX)
+        return PG_INT32_MAX;
+
+    return (int32) bin;
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gin_extract_value);
+Datum spectrum_gin_extract_value(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum;
+    void *spec = spectrum_detoast_mz(PG_GETARG_DATUM(0), &spectrum);
+    int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+
+    Datum *keys = palloc(Max(spectrum.count, 1) * sizeof(Datum));
+    int count = 0;
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        /* NaN has no bin, such peaks are not indexed */
+        if(isnan(cursor.mz))
+            continue;
+
+        int32 bin = mz_bin(cursor.mz);
+
+        if(count == 0 || DatumGetInt32(keys[count - 1]) != bin)
+            keys[count++] = Int32GetDatum(bin);
+    }
+
+    PG_FREE_IF_COPY(spec, 0);
+
+    *nkeys = count;
+    PG_RETURN_POINTER(keys);
+}
+
+
+/*
+ * Returns the bins covering the tolerance window of the query peak, the window is widened by the slack and by
+ * the relative error of float4 m/z values.
+ */
+static inline void window_bins(float4 mz, float4 tolerance, float4 slack, int32 *low, int32 *high)
+{
+    *low = mz_bin(mz - tolerance - slack - fabsf(mz) * 1e-6);
+    *high = mz_bin(mz + tolerance + slack + fabsf(mz) * 1e-6);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gin_extract_query);
+Datum spectrum_gin_extract_query(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum;
+    void *spec = spectrum_detoast_mz(PG_GETARG_DATUM(0), &spectrum);
+    int32 *nkeys = (int32 *) PG_GETARG_POINTER(1);
+    StrategyNumber strategy = PG_GETARG_UINT16(2);
+    Pointer **extra_data = (Pointer **) PG_GETARG_POINTER(4);
+    int32 *searchMode = (int32 *) PG_GETARG_POINTER(6);
+
+    float4 tolerance = similarity_tolerance;
+    float4 slack = tolerance * 1e-3;
+
+    *nkeys = 0;
+
+    if(strategy == SIMILARITY_STRATEGY)
+    {
+        /* any pair of spectra reaches the zero threshold, even if they do not share a peak */
+        if(similarity_threshold <= 0)
+            *searchMode = GIN_SEARCH_MODE_ALL;
+    }
+    else if(strategy == OVERLAP_STRATEGY)
+    {
+        if(min_shared_peaks <= 0)
+            *searchMode = GIN_SEARCH_MODE_ALL;
+    }
+    else
+    {
+        elog(ERROR, "unrecognized strategy number: %d", strategy);
+    }
+
+    if(*searchMode == GIN_SEARCH_MODE_ALL || spectrum.count == 0 || 2 * (tolerance + slack) / BIN_WIDTH > MAX_WINDOW_BINS)
+    {
+        if(spectrum.count != 0)
+            *searchMode = GIN_SEARCH_MODE_ALL;
+
+        PG_FREE_IF_COPY(spec, 0);
+        PG_RETURN_POINTER(NULL);
+    }
+
+    SpectrumCursor cursor;
+    int64 total = 0;
+
+    /*
+     * The relative error widens windows of peaks with high m/z values beyond the tolerance. The windows of non-finite
+     * m/z values cannot be covered by bins.
+     */
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        int32 low;
+        int32 high;
+
+        if(isfinite(cursor.mz))
+            window_bins(cursor.mz, tolerance, slack, &low, &high);
+
+        if(!isfinite(cursor.mz) || (int64) high - low + 1 > MAX_WINDOW_BINS)
+        {
+            *searchMode = GIN_SEARCH_MODE_ALL;
+
+            PG_FREE_IF_COPY(spec, 0);
+            PG_RETURN_POINTER(NULL);
+        }
+
+        total += Max((int64) high - low + 1, 0);
+    }
+
+    QueryPeaks *peaks = palloc(sizeof(QueryPeaks));
+    peaks->count = spectrum.count;
+    peaks->first = palloc(spectrum.count * sizeof(int));
+    peaks->last = palloc(spectrum.count * sizeof(int));
+
+    Datum *keys = palloc(Max(total, 1) * sizeof(Datum));
+    int count = 0;
+    int64 last = PG_INT64_MIN;
+
+    /* windows of sorted peaks are sorted too, so the keys can be deduplicated on the fly */
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        int32 low;
+        int32 high;
+        window_bins(cursor.mz, tolerance, slack, &low, &high);
+
+        peaks->first[cursor.index] = low > last ? count : count - (int) (last - low + 1);
+
+        for(int64 bin = Max(low, last + 1); bin <= high; bin++)
+            keys[count++] = Int32GetDatum((int32) bin);
+
+        if(high > last)
+            last = high;
+
+        peaks->last[cursor.index] = count - 1;
+    }
+
+    PG_FREE_IF_COPY(spec, 0);
+
+    *extra_data = palloc(count * sizeof(Pointer));
+
+    for(int i = 0; i < count; i++)
+        (*extra_data)[i] = (Pointer) peaks;
+
+    *nkeys = count;
+    PG_RETURN_POINTER(keys);
+}
+
+
+/*
+ * Every shared fragment needs a query peak having an indexed peak in one of its bins, so the number of such query
+ * peaks is an upper bound of the number of shared fragments.
+ */
+PG_FUNCTION_INFO_V1(spectrum_gin_consistent);
+Datum spectrum_gin_consistent(PG_FUNCTION_ARGS)
+{
+    bool *check = (bool *) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = PG_GETARG_UINT16(1);
+    int32 nkeys = PG_GETARG_INT32(3);
+    Pointer *extra_data = (Pointer *) PG_GETARG_POINTER(4);
+    bool *recheck = (bool *) PG_GETARG_POINTER(5);
+
+    /* bins are much coarser than the exact kernels */
+    *recheck = true;
+
+    if(nkeys == 0)
+        PG_RETURN_BOOL(true);
+
+    int required = strategy == OVERLAP_STRATEGY ? min_shared_peaks : 1;
+
+    if(required <= 1)
+    {
+        for(int i = 0; i < nkeys; i++)
+            if(check[i])
+                PG_RETURN_BOOL(true);
+
+        PG_RETURN_BOOL(false);
+    }
+
+    QueryPeaks *peaks = (QueryPeaks *) extra_data[0];
+    int shared = 0;
+
+    for(int i = 0; i < peaks->count; i++)
+    {
+        /* the remaining peaks cannot reach the limit */
+        if(shared + peaks->count - i < required)
+            PG_RETURN_BOOL(false);
+
+        for(int k = peaks->first[i]; k <= peaks->last[i]; k++)
+        {
+            if(check[k])
+            {
+                if(++shared >= required)
+                    PG_RETURN_BOOL(true);
+
+                break;
+            }
+        }
+    }
+
+    PG_RETURN_BOOL(false);
+}
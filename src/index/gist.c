@@ -0,0 +1,491 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <access/gist.h>
+#include "pgms.h"
+#include "spectrum.h"
+#include "similarity/cosine.h"
+
+
+#define SIMILARITY_STRATEGY     1
+
+/*
+ * The signature folds m/z values into SIGNATURE_BINS bins of SIGNATURE_BIN_WIDTH Daltons (modulo the number of
+ * bins). Each bin holds an upper bound of the intensities of the peaks falling into it, relative to the norm of their
+ * spectrum and quantized upwards to SIGNATURE_LEVELS levels. The signature of an internal page entry holds the
+ * maximal bounds of its subtree.
+ */
+#define SIGNATURE_BINS          256
+#define SIGNATURE_BIN_WIDTH     1.0
+#define SIGNATURE_LEVELS        255
+
+/* slack covering rounding errors of the exact kernel */
+#define BOUND_EPSILON           1e-4
+
+
+typedef struct
+{
+    int32 vl_len_;
+    float4 mz_min;
+    float4 mz_max;
+    uint8 bound[SIGNATURE_BINS];
+}
+SpectrumSignature;
+
+
+typedef struct
+{
+    void *query;
+    float4 tolerance;
+    int count;
+    float4 mz_min;
+    float4 mz_max;
+    int64 *low;
+    int64 *high;
+    float4 *weight;
+    bool unbounded;
+}
+SignatureQuery;
+
+
+/*
+ * Returns the bin of the m/z value, the bins of huge and infinite values are clamped, so that the differences of bins
+ * do not overflow. The m/z value must not be NaN.
+ */
+static inline int64 signature_bin(float4 mz)
+{
+    double bin = floor(mz / SIGNATURE_BIN_WIDTH);
+
+    if(bin < PG_INT32_MIN)
+        return PG_INT32_MIN;
+    else if(bin > PG_INT32_MAX)
+        return PG_INT32_MAX;
+
+    return (int64) bin;
+}
+
+
+static inline int signature_fold(int64 bin)
+{
+    int result = bin % SIGNATURE_BINS;
+    return result < 0 ? result + SIGNATURE_BINS : result;
+}
+
+
+static SpectrumSignature *signature_create(Datum datum)
+{
+    void *value = PG_DETOAST_DATUM(datum);
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    SpectrumSignature *signature = palloc0(sizeof(SpectrumSignature));
+    SET_VARSIZE(signature, sizeof(SpectrumSignature));
+
+    signature->mz_min = spectrum.count ? spectrum_mz_min(&spectrum) : INFINITY;
+    signature->mz_max = spectrum.count ? spectrum_mz_max(&spectrum) : -INFINITY;
+
+    float4 norm = sqrtf(calc_simple_norm(&spectrum));
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        float4 weight = fabsf(spectrum_intensity(&spectrum, cursor.index)) / norm;
+        int level = SIGNATURE_LEVELS;
+
+        if(isfinite(weight) && weight * SIGNATURE_LEVELS < SIGNATURE_LEVELS)
+            level = (int) ceilf(weight * SIGNATURE_LEVELS);
+
+        /* NaN has no bin, so the peak is accounted in all bins to keep the bounds valid */
+        if(isnan(cursor.mz))
+        {
+            for(int bin = 0; bin < SIGNATURE_BINS; bin++)
+                if(signature->bound[bin] < level)
+                    signature->bound[bin] = level;
+
+            continue;
+        }
+
+        int bin = signature_fold(signature_bin(cursor.mz));
+
+        if(signature->bound[bin] < level)
+            signature->bound[bin] = level;
+    }
+
+    if((Pointer) value != DatumGetPointer(datum))
+        pfree(value);
+
+    return signature;
+}
+
+
+static void signature_merge(SpectrumSignature *signature, const SpectrumSignature *other)
+{
+    if(signature->mz_min > other->mz_min)
+        signature->mz_min = other->mz_min;
+
+    if(signature->mz_max < other->mz_max)
+        signature->mz_max = other->mz_max;
+
+    for(int i = 0; i < SIGNATURE_BINS; i++)
+        if(signature->bound[i] < other->bound[i])
+            signature->bound[i] = other->bound[i];
+}
+
+
+static float signature_penalty(const SpectrumSignature *signature, const SpectrumSignature *other)
+{
+    int penalty = 0;
+
+    for(int i = 0; i < SIGNATURE_BINS; i++)
+        if(signature->bound[i] < other->bound[i])
+            penalty += other->bound[i] - signature->bound[i];
+
+    return penalty;
+}
+
+
+static int signature_distance(const SpectrumSignature *signature, const SpectrumSignature *other)
+{
+    int distance = 0;
+
+    for(int i = 0; i < SIGNATURE_BINS; i++)
+        distance += abs(signature->bound[i] - other->bound[i]);
+
+    return distance;
+}
+
+
+/*
+ * Prepares the query for bound computations. The result is cached in fn_extra, as the query stays the same during
+ * the whole index scan.
+ */
+static SignatureQuery *signature_query(FunctionCallInfo fcinfo, Datum datum, float4 tolerance)
+{
+    void *value = PG_DETOAST_DATUM(datum);
+    SignatureQuery *query = (SignatureQuery *) fcinfo->flinfo->fn_extra;
+
+    if(query != NULL && query->tolerance == tolerance && VARSIZE(query->query) == VARSIZE(value) &&
+            memcmp(query->query, value, VARSIZE(value)) == 0)
+    {
+        if((Pointer) value != DatumGetPointer(datum))
+            pfree(value);
+
+        return query;
+    }
+
+    if(query != NULL)
+    {
+        pfree(query->query);
+        pfree(query->low);
+        pfree(query->high);
+        pfree(query->weight);
+        pfree(query);
+    }
+
+    MemoryContext oldcontext = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    query = palloc0(sizeof(SignatureQuery));
+    query->query = palloc(VARSIZE(value));
+    memcpy(query->query, value, VARSIZE(value));
+    query->tolerance = tolerance;
+    query->count = spectrum.count;
+    query->low = palloc(Max(spectrum.count, 1) * sizeof(int64));
+    query->high = palloc(Max(spectrum.count, 1) * sizeof(int64));
+    query->weight = palloc(Max(spectrum.count, 1) * sizeof(float4));
+
+    float4 norm = sqrtf(calc_simple_norm(&spectrum));
+
+    /* such query cannot be bounded reasonably */
+    query->unbounded = !isfinite(norm) || norm == 0 || !isfinite(tolerance);
+
+    if(spectrum.count)
+    {
+        query->mz_min = spectrum_mz_min(&spectrum) - tolerance;
+        query->mz_max = spectrum_mz_max(&spectrum) + tolerance;
+    }
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        int i = cursor.index;
+        float4 slack = tolerance * 1e-3 + fabsf(cursor.mz) * 1e-6;
+
+        /* the bins are not needed for unbounded queries, and the windows of non-finite m/z values cannot be covered */
+        if(query->unbounded || !isfinite(cursor.mz))
+        {
+            query->unbounded = true;
+            break;
+        }
+
+        query->low[i] = signature_bin(cursor.mz - tolerance - slack);
+        query->high[i] = signature_bin(cursor.mz + tolerance + slack);
+        query->weight[i] = fabsf(spectrum_intensity(&spectrum, i)) / norm;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    if((Pointer) value != DatumGetPointer(datum))
+        pfree(value);
+
+    fcinfo->flinfo->fn_extra = query;
+    return query;
+}
+
+
+/*
+ * Computes an upper bound of the cosine greedy score of the query and any spectrum covered by the signature. Every
+ * query peak is matched at most once, and its partner has to fall into one of the bins of its tolerance window.
+ */
+static float signature_bound(const SignatureQuery *query, const SpectrumSignature *signature)
+{
+    if(query->unbounded)
+        return INFINITY;
+
+    if(query->count == 0 || signature->mz_max < query->mz_min || signature->mz_min > query->mz_max)
+        return 0;
+
+    int global = -1;
+    float bound = 0;
+
+    for(int i = 0; i < query->count; i++)
+    {
+        int max = 0;
+
+        if(query->high[i] - query->low[i] + 1 >= SIGNATURE_BINS)
+        {
+            if(global < 0)
+            {
+                global = 0;
+
+                for(int b = 0; b < SIGNATURE_BINS; b++)
+                    if(global < signature->bound[b])
+                        global = signature->bound[b];
+            }
+
+            max = global;
+        }
+        else
+        {
+            for(int64 b = query->low[i]; b <= query->high[i]; b++)
+            {
+                int level = signature->bound[signature_fold(b)];
+
+                if(max < level)
+                    max = level;
+            }
+        }
+
+        bound += query->weight[i] * max;
+    }
+
+    return bound / SIGNATURE_LEVELS;
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_consistent);
+Datum spectrum_gist_consistent(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    StrategyNumber strategy = (StrategyNumber) PG_GETARG_UINT16(2);
+    bool *recheck = (bool *) PG_GETARG_POINTER(4);
+
+    if(strategy != SIMILARITY_STRATEGY)
+        elog(ERROR, "unrecognized strategy number: %d", strategy);
+
+    SpectrumSignature *signature = (SpectrumSignature *) DatumGetPointer(entry->key);
+    SignatureQuery *query = signature_query(fcinfo, PG_GETARG_DATUM(1), similarity_tolerance);
+
+    /* the signature is lossy, so the exact kernel has to be evaluated anyway */
+    *recheck = true;
+
+    float bound = signature_bound(query, signature);
+
+    PG_RETURN_BOOL(bound * (1 + BOUND_EPSILON) + BOUND_EPSILON >= similarity_threshold);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_union);
+Datum spectrum_gist_union(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    int *size = (int *) PG_GETARG_POINTER(1);
+
+    SpectrumSignature *result = palloc(sizeof(SpectrumSignature));
+    memcpy(result, DatumGetPointer(entryvec->vector[0].key), sizeof(SpectrumSignature));
+
+    for(int i = 1; i < entryvec->n; i++)
+        signature_merge(result, (SpectrumSignature *) DatumGetPointer(entryvec->vector[i].key));
+
+    *size = sizeof(SpectrumSignature);
+    PG_RETURN_POINTER(result);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_compress);
+Datum spectrum_gist_compress(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+
+    if(!entry->leafkey)
+        PG_RETURN_POINTER(entry);
+
+    GISTENTRY *retval = palloc(sizeof(GISTENTRY));
+    gistentryinit(*retval, PointerGetDatum(signature_create(entry->key)), entry->rel, entry->page, entry->offset, false);
+
+    PG_RETURN_POINTER(retval);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_decompress);
+Datum spectrum_gist_decompress(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *entry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    void *key = PG_DETOAST_DATUM(entry->key);
+
+    if(key == DatumGetPointer(entry->key))
+        PG_RETURN_POINTER(entry);
+
+    GISTENTRY *retval = palloc(sizeof(GISTENTRY));
+    gistentryinit(*retval, PointerGetDatum(key), entry->rel, entry->page, entry->offset, false);
+
+    PG_RETURN_POINTER(retval);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_penalty);
+Datum spectrum_gist_penalty(PG_FUNCTION_ARGS)
+{
+    GISTENTRY *origentry = (GISTENTRY *) PG_GETARG_POINTER(0);
+    GISTENTRY *newentry = (GISTENTRY *) PG_GETARG_POINTER(1);
+    float *penalty = (float *) PG_GETARG_POINTER(2);
+
+    SpectrumSignature *orig = (SpectrumSignature *) DatumGetPointer(origentry->key);
+    SpectrumSignature *new = (SpectrumSignature *) DatumGetPointer(newentry->key);
+
+    *penalty = signature_penalty(orig, new);
+
+    PG_RETURN_POINTER(penalty);
+}
+
+
+/*
+ * Splits the entries around the two most distant signatures, assigning every other entry to the side whose union
+ * grows less.
+ */
+PG_FUNCTION_INFO_V1(spectrum_gist_picksplit);
+Datum spectrum_gist_picksplit(PG_FUNCTION_ARGS)
+{
+    GistEntryVector *entryvec = (GistEntryVector *) PG_GETARG_POINTER(0);
+    GIST_SPLITVEC *v = (GIST_SPLITVEC *) PG_GETARG_POINTER(1);
+
+    OffsetNumber maxoff = entryvec->n - 1;
+    size_t nbytes = (maxoff + 2) * sizeof(OffsetNumber);
+
+    v->spl_left = (OffsetNumber *) palloc(nbytes);
+    v->spl_right = (OffsetNumber *) palloc(nbytes);
+    v->spl_nleft = 0;
+    v->spl_nright = 0;
+
+    OffsetNumber seed1 = FirstOffsetNumber;
+    OffsetNumber seed2 = OffsetNumberNext(FirstOffsetNumber);
+    int max_distance = -1;
+
+    for(OffsetNumber i = FirstOffsetNumber; i < maxoff; i = OffsetNumberNext(i))
+    {
+        SpectrumSignature *signature1 = (SpectrumSignature *) DatumGetPointer(entryvec->vector[i].key);
+
+        for(OffsetNumber j = OffsetNumberNext(i); j <= maxoff; j = OffsetNumberNext(j))
+        {
+            SpectrumSignature *signature2 = (SpectrumSignature *) DatumGetPointer(entryvec->vector[j].key);
+            int distance = signature_distance(signature1, signature2);
+
+            if(distance > max_distance)
+            {
+                max_distance = distance;
+                seed1 = i;
+                seed2 = j;
+            }
+        }
+    }
+
+    SpectrumSignature *left = palloc(sizeof(SpectrumSignature));
+    SpectrumSignature *right = palloc(sizeof(SpectrumSignature));
+    memcpy(left, DatumGetPointer(entryvec->vector[seed1].key), sizeof(SpectrumSignature));
+    memcpy(right, DatumGetPointer(entryvec->vector[seed2].key), sizeof(SpectrumSignature));
+
+    for(OffsetNumber i = FirstOffsetNumber; i <= maxoff; i = OffsetNumberNext(i))
+    {
+        SpectrumSignature *signature = (SpectrumSignature *) DatumGetPointer(entryvec->vector[i].key);
+
+        if(i == seed1)
+        {
+            v->spl_left[v->spl_nleft++] = i;
+            continue;
+        }
+        else if(i == seed2)
+        {
+            v->spl_right[v->spl_nright++] = i;
+            continue;
+        }
+
+        float penalty_left = signature_penalty(left, signature);
+        float penalty_right = signature_penalty(right, signature);
+
+        if(penalty_left < penalty_right || (penalty_left == penalty_right && v->spl_nleft <= v->spl_nright))
+        {
+            signature_merge(left, signature);
+            v->spl_left[v->spl_nleft++] = i;
+        }
+        else
+        {
+            signature_merge(right, signature);
+            v->spl_right[v->spl_nright++] = i;
+        }
+    }
+
+    v->spl_ldatum = PointerGetDatum(left);
+    v->spl_rdatum = PointerGetDatum(right);
+
+    PG_RETURN_POINTER(v);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_gist_same);
+Datum spectrum_gist_same(PG_FUNCTION_ARGS)
+{
+    SpectrumSignature *signature1 = (SpectrumSignature *) PG_GETARG_POINTER(0);
+    SpectrumSignature *signature2 = (SpectrumSignature *) PG_GETARG_POINTER(1);
+    bool *result = (bool *) PG_GETARG_POINTER(2);
+
+    *result = memcmp(signature1, signature2, sizeof(SpectrumSignature)) == 0;
+
+    PG_RETURN_POINTER(result);
+}
@@ -0,0 +1,1136 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <access/amapi.h>
+#include <access/generic_xlog.h>
+#include <access/reloptions.h>
+#include <access/relscan.h>
+#include <access/tableam.h>
+#include <catalog/index.h>
+#if PG_VERSION_NUM >= 150000
+#include <common/pg_prng.h>
+#endif
+#include <commands/vacuum.h>
+#include <lib/pairingheap.h>
+#include <miscadmin.h>
+#include <storage/bufmgr.h>
+#include <storage/lmgr.h>
+#include <utils/float.h>
+#include <utils/hsearch.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/selfuncs.h>
+#include "pgms.h"
+#include "spectrum.h"
+
+
+/*
+ * The index is a hierarchical navigable small world graph built over fixed-dimensional embeddings of spectra. Peaks
+ * are binned by HNSW_BIN_WIDTH Daltons, the bins are hashed into the given number of dimensions and the resulting
+ * vector is normalized, so the distance of embeddings approximates the cosine distance of spectra.
+ *
+ * The first page holds the metadata. Every other page holds graph elements: the heap pointer, the embedding and the
+ * neighbour lists of all levels of the element. Elements are never moved, so their item pointers identify them.
+ * Vacuum only marks elements as deleted; deleted elements are still used to navigate the graph.
+ *
+ * The index returns pgms.hnsw_ef_search nearest candidates. Their order is always rechecked by the executor, which
+ * reranks them by the exact distance operator.
+ */
+#define HNSW_MAGIC                  0x50474D48
+#define HNSW_VERSION                1
+#define HNSW_METAPAGE_BLKNO         0
+#define HNSW_MAX_LEVEL              15
+#define HNSW_BIN_WIDTH              1.0
+
+#define HNSW_DEFAULT_M              16
+#define HNSW_MIN_M                  2
+#define HNSW_MAX_M                  100
+#define HNSW_DEFAULT_EF             64
+#define HNSW_MIN_EF                 4
+#define HNSW_MAX_EF                 1000
+#define HNSW_DEFAULT_DIMENSIONS     256
+#define HNSW_MIN_DIMENSIONS         16
+#define HNSW_MAX_DIMENSIONS         1024
+
+#define HNSW_MAX_ITEM_SIZE          (BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(ItemIdData)))
+
+
+typedef struct
+{
+    int32 vl_len_;
+    int m;
+    int ef_construction;
+    int dimensions;
+}
+HnswOptions;
+
+
+typedef struct
+{
+    uint32 magic;
+    uint32 version;
+    int32 dimensions;
+    int32 m;
+    int32 ef_construction;
+    int32 entry_level;
+    ItemPointerData entry;
+    BlockNumber insert_page;
+}
+HnswMetaPageData;
+
+
+/*
+ * The embedding (float4[dimensions]) and the neighbour lists of levels 0 .. level follow the header. Level 0 lists
+ * can hold 2 * m neighbours, lists of higher levels can hold m neighbours.
+ */
+typedef struct
+{
+    ItemPointerData heaptid;
+    uint8 level;
+    bool deleted;
+}
+HnswElementTupleData;
+
+
+typedef struct
+{
+    uint16 count;
+    ItemPointerData items[FLEXIBLE_ARRAY_MEMBER];
+}
+HnswNeighbourList;
+
+
+typedef struct
+{
+    Relation index;
+    int dimensions;
+    int m;
+    int ef_construction;
+    int max_level;
+}
+HnswGraph;
+
+
+typedef struct
+{
+    pairingheap_node candidate_node;
+    pairingheap_node result_node;
+    ItemPointerData tid;
+    ItemPointerData heaptid;
+    bool deleted;
+    float4 distance;
+    float4 *vector;
+    int count;
+    ItemPointerData *neighbours;
+}
+HnswCandidate;
+
+
+typedef struct
+{
+    bool first;
+    int count;
+    int position;
+    ItemPointerData *results;
+    MemoryContext context;
+}
+HnswScanOpaqueData;
+
+typedef HnswScanOpaqueData *HnswScanOpaque;
+
+
+typedef struct
+{
+    double tuples;
+    MemoryContext context;
+}
+HnswBuildState;
+
+
+#define HnswPageGetMeta(page)       ((HnswMetaPageData *) PageGetContents(page))
+
+
+static relopt_kind hnsw_relopt_kind;
+
+
+static inline int hnsw_capacity(int m, int level)
+{
+    return level == 0 ? 2 * m : m;
+}
+
+
+static inline Size hnsw_list_size(int m, int level)
+{
+    return offsetof(HnswNeighbourList, items) + hnsw_capacity(m, level) * sizeof(ItemPointerData);
+}
+
+
+static Size hnsw_element_size(int dimensions, int m, int level)
+{
+    Size size = sizeof(HnswElementTupleData) + dimensions * sizeof(float4);
+
+    for(int l = 0; l <= level; l++)
+        size += hnsw_list_size(m, l);
+
+    return size;
+}
+
+
+static inline float4 *hnsw_element_vector(HnswElementTupleData *element)
+{
+    return (float4 *) (element + 1);
+}
+
+
+static HnswNeighbourList *hnsw_element_list(const HnswGraph *graph, HnswElementTupleData *element, int level)
+{
+    char *list = (char *) (hnsw_element_vector(element) + graph->dimensions);
+
+    for(int l = 0; l < level; l++)
+        list += hnsw_list_size(graph->m, l);
+
+    return (HnswNeighbourList *) list;
+}
+
+
+static inline float4 hnsw_distance(const float4 *vector1, const float4 *vector2, int dimensions)
+{
+    float4 dot = 0;
+
+    for(int i = 0; i < dimensions; i++)
+        dot += vector1[i] * vector2[i];
+
+    return 1 - dot;
+}
+
+
+/*
+ * Computes the normalized embedding of the spectrum, peaks with non-finite m/z values are ignored. Spectra without
+ * a positive finite norm are embedded as zero vectors, which are equally distant from all other embeddings.
+ */
+static void hnsw_embed(Datum datum, int dimensions, float4 *vector)
+{
+    void *value = PG_DETOAST_DATUM(datum);
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    memset(vector, 0, dimensions * sizeof(float4));
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        double position = floor(cursor.mz / HNSW_BIN_WIDTH);
+
+        /* non-finite m/z values have no bin, the bins of huge values are clamped */
+        if(!isfinite(position))
+            continue;
+
+        uint32 bin = (uint32) (int32) Max(Min(position, PG_INT32_MAX), PG_INT32_MIN);
+        uint32 dimension = ((uint64) (uint32) (bin * 0x9E3779B1) * dimensions) >> 32;
+
+        vector[dimension] += fabsf(spectrum_intensity(&spectrum, cursor.index));
+    }
+
+    float4 norm = 0;
+
+    for(int i = 0; i < dimensions; i++)
+        norm += vector[i] * vector[i];
+
+    norm = sqrtf(norm);
+
+    for(int i = 0; i < dimensions; i++)
+        vector[i] = isfinite(norm) && norm > 0 ? vector[i] / norm : 0;
+
+    if((Pointer) value != DatumGetPointer(datum))
+        pfree(value);
+}
+
+
+static Buffer hnsw_new_buffer(Relation index, ForkNumber forknum)
+{
+#if PG_VERSION_NUM >= 160000
+    return ExtendBufferedRel(BMR_REL(index), forknum, NULL, EB_LOCK_FIRST);
+#else
+    LockRelationForExtension(index, ExclusiveLock);
+    Buffer buffer = ReadBufferExtended(index, forknum, P_NEW, RBM_NORMAL, NULL);
+    LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+    UnlockRelationForExtension(index, ExclusiveLock);
+
+    return buffer;
+#endif
+}
+
+
+static void hnsw_init_meta(Relation index, ForkNumber forknum)
+{
+    HnswOptions *options = (HnswOptions *) index->rd_options;
+
+    Buffer buffer = hnsw_new_buffer(index, forknum);
+
+    if(BufferGetBlockNumber(buffer) != HNSW_METAPAGE_BLKNO)
+        elog(ERROR, "unexpected hnsw metapage block number %u", BufferGetBlockNumber(buffer));
+
+    GenericXLogState *state = GenericXLogStart(index);
+    Page page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+    PageInit(page, BufferGetPageSize(buffer), 0);
+
+    HnswMetaPageData *meta = HnswPageGetMeta(page);
+    meta->magic = HNSW_MAGIC;
+    meta->version = HNSW_VERSION;
+    meta->dimensions = options ? options->dimensions : HNSW_DEFAULT_DIMENSIONS;
+    meta->m = options ? options->m : HNSW_DEFAULT_M;
+    meta->ef_construction = options ? options->ef_construction : HNSW_DEFAULT_EF;
+    meta->entry_level = -1;
+    ItemPointerSetInvalid(&meta->entry);
+    meta->insert_page = InvalidBlockNumber;
+
+    ((PageHeader) page)->pd_lower = ((char *) meta + sizeof(HnswMetaPageData)) - (char *) page;
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(buffer);
+}
+
+
+static void hnsw_read_meta(Relation index, HnswMetaPageData *meta)
+{
+    Buffer buffer = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+    LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+    HnswMetaPageData *data = HnswPageGetMeta(BufferGetPage(buffer));
+
+    if(data->magic != HNSW_MAGIC || data->version != HNSW_VERSION)
+        elog(ERROR, "index \"%s\" is not a valid hnsw index", RelationGetRelationName(index));
+
+    *meta = *data;
+
+    UnlockReleaseBuffer(buffer);
+}
+
+
+static void hnsw_write_meta(Relation index, const HnswMetaPageData *meta)
+{
+    Buffer buffer = ReadBuffer(index, HNSW_METAPAGE_BLKNO);
+    LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+    GenericXLogState *state = GenericXLogStart(index);
+    Page page = GenericXLogRegisterBuffer(state, buffer, 0);
+    *HnswPageGetMeta(page) = *meta;
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(buffer);
+}
+
+
+static void hnsw_open_graph(HnswGraph *graph, Relation index, const HnswMetaPageData *meta)
+{
+    graph->index = index;
+    graph->dimensions = meta->dimensions;
+    graph->m = meta->m;
+    graph->ef_construction = meta->ef_construction;
+    graph->max_level = 0;
+
+    while(graph->max_level < HNSW_MAX_LEVEL &&
+            hnsw_element_size(graph->dimensions, graph->m, graph->max_level + 1) <= HNSW_MAX_ITEM_SIZE)
+        graph->max_level++;
+}
+
+
+static HnswCandidate *hnsw_load(const HnswGraph *graph, const ItemPointerData *tid, const float4 *query, int level)
+{
+    HnswCandidate *candidate = palloc(sizeof(HnswCandidate));
+    candidate->vector = palloc(graph->dimensions * sizeof(float4));
+    candidate->neighbours = palloc(hnsw_capacity(graph->m, level) * sizeof(ItemPointerData));
+
+    Buffer buffer = ReadBuffer(graph->index, ItemPointerGetBlockNumber(tid));
+    LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+    Page page = BufferGetPage(buffer);
+    HnswElementTupleData *element = (HnswElementTupleData *) PageGetItem(page,
+            PageGetItemId(page, ItemPointerGetOffsetNumber(tid)));
+
+    candidate->tid = *tid;
+    candidate->heaptid = element->heaptid;
+    candidate->deleted = element->deleted;
+    candidate->count = 0;
+    memcpy(candidate->vector, hnsw_element_vector(element), graph->dimensions * sizeof(float4));
+
+    if(element->level >= level)
+    {
+        HnswNeighbourList *list = hnsw_element_list(graph, element, level);
+        candidate->count = list->count;
+        memcpy(candidate->neighbours, list->items, list->count * sizeof(ItemPointerData));
+    }
+
+    UnlockReleaseBuffer(buffer);
+
+    candidate->distance = query ? hnsw_distance(query, candidate->vector, graph->dimensions) : 0;
+
+    return candidate;
+}
+
+
+static int hnsw_nearer_cmp(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+{
+    const HnswCandidate *ca = pairingheap_const_container(HnswCandidate, candidate_node, a);
+    const HnswCandidate *cb = pairingheap_const_container(HnswCandidate, candidate_node, b);
+
+    return ca->distance < cb->distance ? 1 : ca->distance > cb->distance ? -1 : 0;
+}
+
+
+static int hnsw_farther_cmp(const pairingheap_node *a, const pairingheap_node *b, void *arg)
+{
+    const HnswCandidate *ca = pairingheap_const_container(HnswCandidate, result_node, a);
+    const HnswCandidate *cb = pairingheap_const_container(HnswCandidate, result_node, b);
+
+    return ca->distance > cb->distance ? 1 : ca->distance < cb->distance ? -1 : 0;
+}
+
+
+/*
+ * Searches the given level of the graph for ef elements nearest to the query, starting from the entry elements.
+ * The result is sorted by the distance.
+ */
+static int hnsw_search_level(const HnswGraph *graph, const float4 *query, const ItemPointerData *entries, int count,
+        int ef, int level, HnswCandidate ***result)
+{
+    HASHCTL ctl;
+    ctl.keysize = sizeof(ItemPointerData);
+    ctl.entrysize = sizeof(ItemPointerData);
+    ctl.hcxt = CurrentMemoryContext;
+
+    HTAB *visited = hash_create("hnsw visited elements", 256, &ctl, HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+
+    pairingheap *candidates = pairingheap_allocate(hnsw_nearer_cmp, NULL);
+    pairingheap *nearest = pairingheap_allocate(hnsw_farther_cmp, NULL);
+    int size = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        bool found;
+        hash_search(visited, &entries[i], HASH_ENTER, &found);
+
+        if(found)
+            continue;
+
+        HnswCandidate *candidate = hnsw_load(graph, &entries[i], query, level);
+        pairingheap_add(candidates, &candidate->candidate_node);
+        pairingheap_add(nearest, &candidate->result_node);
+        size++;
+    }
+
+    while(!pairingheap_is_empty(candidates))
+    {
+        HnswCandidate *candidate = pairingheap_container(HnswCandidate, candidate_node,
+                pairingheap_remove_first(candidates));
+        HnswCandidate *farthest = pairingheap_container(HnswCandidate, result_node, pairingheap_first(nearest));
+
+        if(candidate->distance > farthest->distance)
+            break;
+
+        CHECK_FOR_INTERRUPTS();
+
+        for(int i = 0; i < candidate->count; i++)
+        {
+            bool found;
+            hash_search(visited, &candidate->neighbours[i], HASH_ENTER, &found);
+
+            if(found)
+                continue;
+
+            HnswCandidate *neighbour = hnsw_load(graph, &candidate->neighbours[i], query, level);
+            farthest = pairingheap_container(HnswCandidate, result_node, pairingheap_first(nearest));
+
+            if(size < ef || neighbour->distance < farthest->distance)
+            {
+                pairingheap_add(candidates, &neighbour->candidate_node);
+                pairingheap_add(nearest, &neighbour->result_node);
+
+                if(++size > ef)
+                {
+                    pairingheap_remove_first(nearest);
+                    size--;
+                }
+            }
+        }
+    }
+
+    *result = palloc(Max(size, 1) * sizeof(HnswCandidate *));
+
+    for(int i = size - 1; i >= 0; i--)
+        (*result)[i] = pairingheap_container(HnswCandidate, result_node, pairingheap_remove_first(nearest));
+
+    hash_destroy(visited);
+
+    return size;
+}
+
+
+/*
+ * Selects up to capacity neighbours from the candidates sorted by their distance to the base element. A candidate
+ * is preferred if it is nearer to the base element than to all already selected neighbours; the remaining capacity
+ * is filled by the nearest of the other candidates.
+ */
+static int hnsw_select_neighbours(const HnswGraph *graph, HnswCandidate **candidates, int count, int capacity,
+        HnswCandidate **selected)
+{
+    HnswCandidate **pruned = palloc(Max(count, 1) * sizeof(HnswCandidate *));
+    int nselected = 0;
+    int npruned = 0;
+
+    for(int i = 0; i < count && nselected < capacity; i++)
+    {
+        bool good = true;
+
+        for(int j = 0; j < nselected && good; j++)
+            if(hnsw_distance(candidates[i]->vector, selected[j]->vector, graph->dimensions) < candidates[i]->distance)
+                good = false;
+
+        if(good)
+            selected[nselected++] = candidates[i];
+        else
+            pruned[npruned++] = candidates[i];
+    }
+
+    for(int i = 0; i < npruned && nselected < capacity; i++)
+        selected[nselected++] = pruned[i];
+
+    pfree(pruned);
+
+    return nselected;
+}
+
+
+static int hnsw_candidate_cmp(const void *a, const void *b)
+{
+    float4 da = (*(HnswCandidate * const *) a)->distance;
+    float4 db = (*(HnswCandidate * const *) b)->distance;
+
+    return da < db ? -1 : da > db ? 1 : 0;
+}
+
+
+static void hnsw_write_list(const HnswGraph *graph, const ItemPointerData *tid, int level, HnswCandidate **neighbours,
+        int count)
+{
+    Buffer buffer = ReadBuffer(graph->index, ItemPointerGetBlockNumber(tid));
+    LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+    GenericXLogState *state = GenericXLogStart(graph->index);
+    Page page = GenericXLogRegisterBuffer(state, buffer, 0);
+
+    HnswElementTupleData *element = (HnswElementTupleData *) PageGetItem(page,
+            PageGetItemId(page, ItemPointerGetOffsetNumber(tid)));
+    HnswNeighbourList *list = hnsw_element_list(graph, element, level);
+
+    list->count = count;
+
+    for(int i = 0; i < count; i++)
+        list->items[i] = neighbours[i]->tid;
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(buffer);
+}
+
+
+/*
+ * Adds the new element to the neighbour list of the given element. If the list is full, the neighbours are selected
+ * again from the current ones and the new element.
+ */
+static void hnsw_connect(const HnswGraph *graph, const ItemPointerData *tid, HnswCandidate *element, int level)
+{
+    HnswCandidate *base = hnsw_load(graph, tid, NULL, level);
+    int capacity = hnsw_capacity(graph->m, level);
+
+    HnswCandidate **candidates = palloc((base->count + 1) * sizeof(HnswCandidate *));
+    int count = 0;
+
+    for(int i = 0; i < base->count; i++)
+    {
+        if(ItemPointerEquals(&base->neighbours[i], &element->tid))
+            return;
+
+        candidates[count++] = hnsw_load(graph, &base->neighbours[i], base->vector, level);
+    }
+
+    HnswCandidate *added = palloc(sizeof(HnswCandidate));
+    *added = *element;
+    added->distance = hnsw_distance(base->vector, element->vector, graph->dimensions);
+    candidates[count++] = added;
+
+    if(count > capacity)
+    {
+        qsort(candidates, count, sizeof(HnswCandidate *), hnsw_candidate_cmp);
+
+        HnswCandidate **selected = palloc(capacity * sizeof(HnswCandidate *));
+        count = hnsw_select_neighbours(graph, candidates, count, capacity, selected);
+        candidates = selected;
+    }
+
+    hnsw_write_list(graph, tid, level, candidates, count);
+}
+
+
+static void hnsw_add_element(Relation index, HnswMetaPageData *meta, HnswElementTupleData *element, Size size,
+        ItemPointerData *tid)
+{
+    Buffer buffer = InvalidBuffer;
+    GenericXLogState *state = NULL;
+    Page page = NULL;
+
+    if(meta->insert_page != InvalidBlockNumber)
+    {
+        buffer = ReadBuffer(index, meta->insert_page);
+        LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+        state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buffer, 0);
+
+        if(PageGetFreeSpace(page) < MAXALIGN(size))
+        {
+            GenericXLogAbort(state);
+            UnlockReleaseBuffer(buffer);
+            buffer = InvalidBuffer;
+        }
+    }
+
+    if(buffer == InvalidBuffer)
+    {
+        buffer = hnsw_new_buffer(index, MAIN_FORKNUM);
+
+        state = GenericXLogStart(index);
+        page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+        PageInit(page, BufferGetPageSize(buffer), 0);
+
+        meta->insert_page = BufferGetBlockNumber(buffer);
+    }
+
+    OffsetNumber offset = PageAddItem(page, (Item) element, size, InvalidOffsetNumber, false, false);
+
+    if(offset == InvalidOffsetNumber)
+        elog(ERROR, "failed to add element to hnsw index \"%s\"", RelationGetRelationName(index));
+
+    ItemPointerSet(tid, BufferGetBlockNumber(buffer), offset);
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(buffer);
+}
+
+
+static int hnsw_random_level(const HnswGraph *graph)
+{
+#if PG_VERSION_NUM >= 150000
+    double uniform = 1.0 - pg_prng_double(&pg_global_prng_state);
+#else
+    double uniform = (random() + 1.0) / ((double) PG_INT32_MAX + 2.0);
+#endif
+    int level = (int) (-log(uniform) / log(graph->m));
+
+    return Min(level, graph->max_level);
+}
+
+
+/*
+ * Inserts the spectrum into the graph. Insertions are serialized by a lock of the metapage, concurrent scans see
+ * every page in a consistent state.
+ */
+static void hnsw_insert_spectrum(Relation index, Datum value, ItemPointer heaptid)
+{
+    LockPage(index, HNSW_METAPAGE_BLKNO, ExclusiveLock);
+
+    HnswMetaPageData meta;
+    hnsw_read_meta(index, &meta);
+
+    HnswGraph graph;
+    hnsw_open_graph(&graph, index, &meta);
+
+    int level = hnsw_random_level(&graph);
+    Size size = hnsw_element_size(graph.dimensions, graph.m, level);
+
+    HnswElementTupleData *element = palloc0(size);
+    element->heaptid = *heaptid;
+    element->level = level;
+    element->deleted = false;
+    hnsw_embed(value, graph.dimensions, hnsw_element_vector(element));
+
+    HnswCandidate inserted;
+    inserted.vector = hnsw_element_vector(element);
+    inserted.deleted = false;
+    inserted.heaptid = *heaptid;
+
+    BlockNumber insert_page = meta.insert_page;
+    hnsw_add_element(index, &meta, element, size, &inserted.tid);
+
+    if(!ItemPointerIsValid(&meta.entry))
+    {
+        meta.entry = inserted.tid;
+        meta.entry_level = level;
+        hnsw_write_meta(index, &meta);
+
+        UnlockPage(index, HNSW_METAPAGE_BLKNO, ExclusiveLock);
+        return;
+    }
+
+    ItemPointerData *entries = palloc(sizeof(ItemPointerData));
+    int count = 1;
+    entries[0] = meta.entry;
+
+    for(int l = meta.entry_level; l > level; l--)
+    {
+        HnswCandidate **nearest;
+
+        if(hnsw_search_level(&graph, inserted.vector, entries, count, 1, l, &nearest) > 0)
+            entries[0] = nearest[0]->tid;
+    }
+
+    for(int l = Min(level, meta.entry_level); l >= 0; l--)
+    {
+        HnswCandidate **nearest;
+        int found = hnsw_search_level(&graph, inserted.vector, entries, count, graph.ef_construction, l, &nearest);
+
+        int capacity = hnsw_capacity(graph.m, l);
+        HnswCandidate **selected = palloc(capacity * sizeof(HnswCandidate *));
+        int nselected = hnsw_select_neighbours(&graph, nearest, found, capacity, selected);
+
+        hnsw_write_list(&graph, &inserted.tid, l, selected, nselected);
+
+        for(int i = 0; i < nselected; i++)
+            hnsw_connect(&graph, &selected[i]->tid, &inserted, l);
+
+        entries = palloc(Max(found, 1) * sizeof(ItemPointerData));
+        count = found;
+
+        for(int i = 0; i < found; i++)
+            entries[i] = nearest[i]->tid;
+    }
+
+    bool modified = meta.insert_page != insert_page;
+
+    if(level > meta.entry_level)
+    {
+        meta.entry = inserted.tid;
+        meta.entry_level = level;
+        modified = true;
+    }
+
+    if(modified)
+        hnsw_write_meta(index, &meta);
+
+    UnlockPage(index, HNSW_METAPAGE_BLKNO, ExclusiveLock);
+}
+
+
+static void hnsw_build_callback(Relation index, ItemPointer tid, Datum *values, bool *isnull, bool tupleIsAlive,
+        void *state)
+{
+    HnswBuildState *buildstate = (HnswBuildState *) state;
+
+    if(isnull[0])
+        return;
+
+    MemoryContext oldcontext = MemoryContextSwitchTo(buildstate->context);
+
+    hnsw_insert_spectrum(index, values[0], tid);
+    buildstate->tuples++;
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextReset(buildstate->context);
+}
+
+
+static IndexBuildResult *hnsw_build(Relation heap, Relation index, IndexInfo *indexInfo)
+{
+    if(RelationGetNumberOfBlocks(index) != 0)
+        elog(ERROR, "index \"%s\" already contains data", RelationGetRelationName(index));
+
+    hnsw_init_meta(index, MAIN_FORKNUM);
+
+    HnswBuildState buildstate;
+    buildstate.tuples = 0;
+    buildstate.context = AllocSetContextCreate(CurrentMemoryContext, "hnsw build temporary context",
+            ALLOCSET_DEFAULT_SIZES);
+
+    double reltuples = table_index_build_scan(heap, index, indexInfo, true, true, hnsw_build_callback,
+            (void *) &buildstate, NULL);
+
+    MemoryContextDelete(buildstate.context);
+
+    IndexBuildResult *result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
+    result->heap_tuples = reltuples;
+    result->index_tuples = buildstate.tuples;
+
+    return result;
+}
+
+
+static void hnsw_build_empty(Relation index)
+{
+    hnsw_init_meta(index, INIT_FORKNUM);
+}
+
+
+static bool hnsw_insert(Relation index, Datum *values, bool *isnull, ItemPointer ht_ctid, Relation heapRel,
+        IndexUniqueCheck checkUnique,
+#if PG_VERSION_NUM >= 140000
+        bool indexUnchanged,
+#endif
+        IndexInfo *indexInfo)
+{
+    if(isnull[0])
+        return false;
+
+    MemoryContext context = AllocSetContextCreate(CurrentMemoryContext, "hnsw insert temporary context",
+            ALLOCSET_DEFAULT_SIZES);
+    MemoryContext oldcontext = MemoryContextSwitchTo(context);
+
+    hnsw_insert_spectrum(index, values[0], ht_ctid);
+
+    MemoryContextSwitchTo(oldcontext);
+    MemoryContextDelete(context);
+
+    return false;
+}
+
+
+static IndexBulkDeleteResult *hnsw_bulk_delete(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
+        IndexBulkDeleteCallback callback, void *callback_state)
+{
+    Relation index = info->index;
+
+    if(stats == NULL)
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+    BlockNumber npages = RelationGetNumberOfBlocks(index);
+
+    for(BlockNumber blkno = HNSW_METAPAGE_BLKNO + 1; blkno < npages; blkno++)
+    {
+#if PG_VERSION_NUM >= 180000
+        vacuum_delay_point(false);
+#else
+        vacuum_delay_point();
+#endif
+
+        Buffer buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+        LockBuffer(buffer, BUFFER_LOCK_EXCLUSIVE);
+
+        GenericXLogState *state = GenericXLogStart(index);
+        Page page = GenericXLogRegisterBuffer(state, buffer, 0);
+        OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+        bool modified = false;
+
+        for(OffsetNumber offset = FirstOffsetNumber; offset <= maxoff; offset = OffsetNumberNext(offset))
+        {
+            HnswElementTupleData *element = (HnswElementTupleData *) PageGetItem(page, PageGetItemId(page, offset));
+
+            if(element->deleted)
+                continue;
+
+            if(callback(&element->heaptid, callback_state))
+            {
+                element->deleted = true;
+                stats->tuples_removed++;
+                modified = true;
+            }
+            else
+            {
+                stats->num_index_tuples++;
+            }
+        }
+
+        if(modified)
+            GenericXLogFinish(state);
+        else
+            GenericXLogAbort(state);
+
+        UnlockReleaseBuffer(buffer);
+    }
+
+    return stats;
+}
+
+
+static IndexBulkDeleteResult *hnsw_vacuum_cleanup(IndexVacuumInfo *info, IndexBulkDeleteResult *stats)
+{
+    Relation index = info->index;
+
+    if(info->analyze_only)
+        return stats;
+
+    BlockNumber npages = RelationGetNumberOfBlocks(index);
+
+    if(stats == NULL)
+    {
+        stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
+
+        for(BlockNumber blkno = HNSW_METAPAGE_BLKNO + 1; blkno < npages; blkno++)
+        {
+#if PG_VERSION_NUM >= 180000
+            vacuum_delay_point(false);
+#else
+            vacuum_delay_point();
+#endif
+
+            Buffer buffer = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, info->strategy);
+            LockBuffer(buffer, BUFFER_LOCK_SHARE);
+
+            Page page = BufferGetPage(buffer);
+            OffsetNumber maxoff = PageGetMaxOffsetNumber(page);
+
+            for(OffsetNumber offset = FirstOffsetNumber; offset <= maxoff; offset = OffsetNumberNext(offset))
+                if(!((HnswElementTupleData *) PageGetItem(page, PageGetItemId(page, offset)))->deleted)
+                    stats->num_index_tuples++;
+
+            UnlockReleaseBuffer(buffer);
+        }
+    }
+
+    stats->num_pages = npages;
+
+    return stats;
+}
+
+
+static void hnsw_cost_estimate(PlannerInfo *root, IndexPath *path, double loop_count, Cost *indexStartupCost,
+        Cost *indexTotalCost, Selectivity *indexSelectivity, double *indexCorrelation, double *indexPages)
+{
+    /* the index can only be used to order the rows */
+    if(path->indexorderbys == NIL)
+    {
+        *indexStartupCost = get_float8_infinity();
+        *indexTotalCost = get_float8_infinity();
+        *indexSelectivity = 0;
+        *indexCorrelation = 0;
+        *indexPages = 0;
+        return;
+    }
+
+    GenericCosts costs;
+    MemSet(&costs, 0, sizeof(costs));
+
+    /* elements visited by the search, roughly */
+    costs.numIndexTuples = Min(path->indexinfo->tuples, (double) hnsw_ef_search * HNSW_DEFAULT_M);
+
+    genericcostestimate(root, path, loop_count, &costs);
+
+    /* the whole search is done before the first row is returned */
+    *indexStartupCost = costs.indexTotalCost;
+    *indexTotalCost = costs.indexTotalCost;
+    *indexSelectivity = costs.indexSelectivity;
+    *indexCorrelation = 0;
+    *indexPages = costs.numIndexPages;
+}
+
+
+static bytea *hnsw_options(Datum reloptions, bool validate)
+{
+    static const relopt_parse_elt tab[] =
+    {
+        {"m", RELOPT_TYPE_INT, offsetof(HnswOptions, m)},
+        {"ef_construction", RELOPT_TYPE_INT, offsetof(HnswOptions, ef_construction)},
+        {"dimensions", RELOPT_TYPE_INT, offsetof(HnswOptions, dimensions)}
+    };
+
+    return (bytea *) build_reloptions(reloptions, validate, hnsw_relopt_kind, sizeof(HnswOptions), tab, lengthof(tab));
+}
+
+
+static bool hnsw_validate(Oid opclassoid)
+{
+    return true;
+}
+
+
+static IndexScanDesc hnsw_begin_scan(Relation index, int nkeys, int norderbys)
+{
+    IndexScanDesc scan = RelationGetIndexScan(index, nkeys, norderbys);
+
+    HnswScanOpaque so = (HnswScanOpaque) palloc0(sizeof(HnswScanOpaqueData));
+    so->context = AllocSetContextCreate(CurrentMemoryContext, "hnsw scan temporary context", ALLOCSET_DEFAULT_SIZES);
+    scan->opaque = so;
+
+    return scan;
+}
+
+
+static void hnsw_rescan(IndexScanDesc scan, ScanKey keys, int nkeys, ScanKey orderbys, int norderbys)
+{
+    HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+    if(keys && scan->numberOfKeys > 0)
+        memmove(scan->keyData, keys, scan->numberOfKeys * sizeof(ScanKeyData));
+
+    if(orderbys && scan->numberOfOrderBys > 0)
+        memmove(scan->orderByData, orderbys, scan->numberOfOrderBys * sizeof(ScanKeyData));
+
+    MemoryContextReset(so->context);
+    so->first = true;
+    so->count = 0;
+    so->position = 0;
+    so->results = NULL;
+}
+
+
+static void hnsw_search(IndexScanDesc scan)
+{
+    HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+    Relation index = scan->indexRelation;
+
+    if(scan->numberOfOrderBys == 0 || (scan->orderByData[0].sk_flags & SK_ISNULL))
+        return;
+
+    HnswMetaPageData meta;
+    hnsw_read_meta(index, &meta);
+
+    if(!ItemPointerIsValid(&meta.entry))
+        return;
+
+    HnswGraph graph;
+    hnsw_open_graph(&graph, index, &meta);
+
+    float4 *query = palloc(graph.dimensions * sizeof(float4));
+    hnsw_embed(scan->orderByData[0].sk_argument, graph.dimensions, query);
+
+    ItemPointerData entry = meta.entry;
+    HnswCandidate **nearest;
+
+    for(int l = meta.entry_level; l > 0; l--)
+        if(hnsw_search_level(&graph, query, &entry, 1, 1, l, &nearest) > 0)
+            entry = nearest[0]->tid;
+
+    int found = hnsw_search_level(&graph, query, &entry, 1, hnsw_ef_search, 0, &nearest);
+
+    so->results = palloc(Max(found, 1) * sizeof(ItemPointerData));
+
+    for(int i = 0; i < found; i++)
+        if(!nearest[i]->deleted)
+            so->results[so->count++] = nearest[i]->heaptid;
+}
+
+
+static bool hnsw_get_tuple(IndexScanDesc scan, ScanDirection dir)
+{
+    HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+    if(so->first)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(so->context);
+        hnsw_search(scan);
+        MemoryContextSwitchTo(oldcontext);
+
+        so->first = false;
+    }
+
+    if(so->position >= so->count)
+        return false;
+
+    scan->xs_heaptid = so->results[so->position++];
+    scan->xs_recheck = false;
+
+    /*
+     * Embedding distances only approximate the exact ones, so the reported distance is just a trivial lower bound
+     * and the executor reorders all candidates by the exact distance.
+     */
+    scan->xs_recheckorderby = true;
+    scan->xs_orderbyvals[0] = Float4GetDatum(0);
+    scan->xs_orderbynulls[0] = false;
+
+    return true;
+}
+
+
+static void hnsw_end_scan(IndexScanDesc scan)
+{
+    HnswScanOpaque so = (HnswScanOpaque) scan->opaque;
+
+    MemoryContextDelete(so->context);
+    pfree(so);
+    scan->opaque = NULL;
+}
+
+
+void hnsw_init(void)
+{
+    hnsw_relopt_kind = add_reloption_kind();
+
+    add_int_reloption(hnsw_relopt_kind, "m", "Maximal number of neighbours of an element on upper graph levels",
+            HNSW_DEFAULT_M, HNSW_MIN_M, HNSW_MAX_M, AccessExclusiveLock);
+    add_int_reloption(hnsw_relopt_kind, "ef_construction", "Size of the candidate list used during the index build",
+            HNSW_DEFAULT_EF, HNSW_MIN_EF, HNSW_MAX_EF, AccessExclusiveLock);
+    add_int_reloption(hnsw_relopt_kind, "dimensions", "Number of dimensions of the spectrum embeddings",
+            HNSW_DEFAULT_DIMENSIONS, HNSW_MIN_DIMENSIONS, HNSW_MAX_DIMENSIONS, AccessExclusiveLock);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_hnsw_handler);
+Datum spectrum_hnsw_handler(PG_FUNCTION_ARGS)
+{
+    IndexAmRoutine *amroutine = makeNode(IndexAmRoutine);
+
+    amroutine->amstrategies = 0;
+    amroutine->amsupport = 0;
+    amroutine->amoptsprocnum = 0;
+    amroutine->amcanorder = false;
+    amroutine->amcanorderbyop = true;
+    amroutine->amcanbackward = false;
+    amroutine->amcanunique = false;
+    amroutine->amcanmulticol = false;
+    amroutine->amoptionalkey = true;
+    amroutine->amsearcharray = false;
+    amroutine->amsearchnulls = false;
+    amroutine->amstorage = false;
+    amroutine->amclusterable = false;
+    amroutine->ampredlocks = false;
+    amroutine->amcanparallel = false;
+    amroutine->amcaninclude = false;
+    amroutine->amusemaintenanceworkmem = false;
+    amroutine->amparallelvacuumoptions = VACUUM_OPTION_PARALLEL_BULKDEL;
+    amroutine->amkeytype = InvalidOid;
+
+    amroutine->ambuild = hnsw_build;
+    amroutine->ambuildempty = hnsw_build_empty;
+    amroutine->aminsert = hnsw_insert;
+    amroutine->ambulkdelete = hnsw_bulk_delete;
+    amroutine->amvacuumcleanup = hnsw_vacuum_cleanup;
+    amroutine->amcanreturn = NULL;
+    amroutine->amcostestimate = hnsw_cost_estimate;
+    amroutine->amoptions = hnsw_options;
+    amroutine->amproperty = NULL;
+    amroutine->ambuildphasename = NULL;
+    amroutine->amvalidate = hnsw_validate;
+    amroutine->ambeginscan = hnsw_begin_scan;
+    amroutine->amrescan = hnsw_rescan;
+    amroutine->amgettuple = hnsw_get_tuple;
+    amroutine->amgetbitmap = NULL;
+    amroutine->amendscan = hnsw_end_scan;
+    amroutine->ammarkpos = NULL;
+    amroutine->amrestrpos = NULL;
+    amroutine->amestimateparallelscan = NULL;
+    amroutine->aminitparallelscan = NULL;
+    amroutine->amparallelrescan = NULL;
+
+    PG_RETURN_POINTER(amroutine);
+}
@@ -18,19 +18,53 @@
  */
 
 #include <postgres.h>
+#include <limits.h>
 #include <fmgr.h>
 #include <funcapi.h>
 #include <catalog/namespace.h>
+#include <utils/guc.h>
 #include <utils/syscache.h>
+#include "pgms.h"
+#include "simd.h"
 
 PG_MODULE_MAGIC;
 
 
 Oid spectrumOid;
 
+double similarity_threshold = 0.7;
+double similarity_tolerance = 0.1;
+int min_shared_peaks = 1;
+int hnsw_ef_search = 40;
+
 
 void _PG_init()
 {
+    DefineCustomRealVariable("pgms.similarity_threshold",
+            "Sets the cosine greedy similarity threshold used by the % operator.",
+            NULL, &similarity_threshold, 0.7, 0.0, 1.0, PGC_USERSET, 0, NULL, NULL, NULL);
+
+    DefineCustomRealVariable("pgms.similarity_tolerance",
+            "Sets the m/z tolerance used by the %, && and <-> operators.",
+            NULL, &similarity_tolerance, 0.1, 0.0, 1000.0, PGC_USERSET, 0, NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pgms.min_shared_peaks",
+            "Sets the minimal number of shared peaks required by the && operator.",
+            NULL, &min_shared_peaks, 1, 0, INT_MAX, PGC_USERSET, 0, NULL, NULL, NULL);
+
+    DefineCustomIntVariable("pgms.hnsw_ef_search",
+            "Sets the number of candidates returned by hnsw index scans.",
+            NULL, &hnsw_ef_search, 40, 1, 1000, PGC_USERSET, 0, NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+    MarkGUCPrefixReserved("pgms");
+#else
+    EmitWarningsOnPlaceholders("pgms");
+#endif
+
+    simd_init();
+    hnsw_init();
+
     Oid spaceid = LookupExplicitNamespace("pgms", false);
     spectrumOid = GetSysCacheOid2(TYPENAMENSP, Anum_pg_type_oid, PointerGetDatum("spectrum"), ObjectIdGetDatum(spaceid));
 }
@@ -25,4 +25,11 @@
 
 extern Oid spectrumOid;
 
+extern double similarity_threshold;
+extern double similarity_tolerance;
+extern int min_shared_peaks;
+extern int hnsw_ef_search;
+
+void hnsw_init(void);
+
 #endif /* PGMS_H_ */
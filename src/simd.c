@@ -0,0 +1,355 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#ifdef USE_X86_SIMD
+#include <immintrin.h>
+#endif
+#include "simd.h"
+
+
+/*
+ * Sums are accumulated in SUM_LANES partial sums (the i-th value is added to the partial sum i % SUM_LANES), which are
+ * then reduced pairwise. It corresponds to one AVX-512 register or to two AVX2 registers.
+ */
+#define SUM_LANES       16
+
+/*
+ * Sparse dot products intersect blocks of DOT_LANES indices of both vectors, the product of the k-th value of a block
+ * of the first vector and its matching value is added to the partial sum k. Matches of the values following the last
+ * pair of complete blocks are summed separately. It corresponds to one AVX2 register.
+ */
+#define DOT_LANES       8
+
+
+static inline float4 reduce_lanes(float4 *lanes, int count)
+{
+    for(int width = count / 2; width > 0; width /= 2)
+        for(int i = 0; i < width; i++)
+            lanes[i] += lanes[i + width];
+
+    return lanes[0];
+}
+
+
+static int skip_below_scalar(const float4 *values, int start, int count, float4 bound)
+{
+    int i = start;
+
+    while(i < count && values[i] < bound)
+        i++;
+
+    return i;
+}
+
+
+static float4 sum_squares_scalar(const float4 *values, int count)
+{
+    float4 lanes[SUM_LANES] = { 0 };
+    int i = 0;
+
+    for(; i + SUM_LANES <= count; i += SUM_LANES)
+        for(int j = 0; j < SUM_LANES; j++)
+            lanes[j] += values[i + j] * values[i + j];
+
+    for(; i < count; i++)
+        lanes[i % SUM_LANES] += values[i] * values[i];
+
+    return reduce_lanes(lanes, SUM_LANES);
+}
+
+
+static float4 max_scalar(const float4 *values, int count)
+{
+    float4 max = 0;
+
+    for(int i = 0; i < count; i++)
+        if(max < values[i])
+            max = values[i];
+
+    return max;
+}
+
+
+/*
+ * Returns the sum of products of the values with matching indices, the indices of both vectors have to start at the given
+ * positions.
+ */
+static float4 sparse_dot_tail(const int32 *indices1, const float4 *values1, int i, int count1, const int32 *indices2,
+        const float4 *values2, int j, int count2)
+{
+    float4 sum = 0;
+
+    while(i < count1 && j < count2)
+    {
+        if(indices1[i] < indices2[j])
+        {
+            i++;
+        }
+        else if(indices1[i] > indices2[j])
+        {
+            j++;
+        }
+        else
+        {
+            sum += values1[i] * values2[j];
+            i++;
+            j++;
+        }
+    }
+
+    return sum;
+}
+
+
+/*
+ * The scalar version first finds where the vector versions leave the loop over the blocks, and then it merges
+ * the vectors and adds each product to the same partial sum as they do.
+ */
+static float4 sparse_dot_scalar(const int32 *indices1, const float4 *values1, int count1, const int32 *indices2,
+        const float4 *values2, int count2)
+{
+    int end1 = 0;
+    int end2 = 0;
+
+    while(end1 + DOT_LANES <= count1 && end2 + DOT_LANES <= count2)
+    {
+        int32 last1 = indices1[end1 + DOT_LANES - 1];
+        int32 last2 = indices2[end2 + DOT_LANES - 1];
+
+        if(last1 <= last2)
+            end1 += DOT_LANES;
+
+        if(last2 <= last1)
+            end2 += DOT_LANES;
+    }
+
+    float4 lanes[DOT_LANES] = { 0 };
+    int i = 0;
+    int j = 0;
+
+    while(i < count1 && j < count2 && (i < end1 || j < end2))
+    {
+        if(indices1[i] < indices2[j])
+        {
+            i++;
+        }
+        else if(indices1[i] > indices2[j])
+        {
+            j++;
+        }
+        else
+        {
+            lanes[i % DOT_LANES] += values1[i] * values2[j];
+            i++;
+            j++;
+        }
+    }
+
+    float4 tail = sparse_dot_tail(indices1, values1, Max(i, end1), count1, indices2, values2, Max(j, end2), count2);
+
+    return reduce_lanes(lanes, DOT_LANES) + tail;
+}
+
+
+#ifdef USE_X86_SIMD
+
+__attribute__((target("avx2")))
+static int skip_below_avx2(const float4 *values, int start, int count, float4 bound)
+{
+    __m256 limit = _mm256_set1_ps(bound);
+    int i = start;
+
+    for(; i + 8 <= count; i += 8)
+    {
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), limit, _CMP_LT_OQ));
+
+        if(mask != 0xFF)
+            return i + __builtin_ctz(~mask);
+    }
+
+    return skip_below_scalar(values, i, count, bound);
+}
+
+
+__attribute__((target("avx2")))
+static float4 sum_squares_avx2(const float4 *values, int count)
+{
+    __m256 low = _mm256_setzero_ps();
+    __m256 high = _mm256_setzero_ps();
+    int i = 0;
+
+    for(; i + SUM_LANES <= count; i += SUM_LANES)
+    {
+        __m256 value1 = _mm256_loadu_ps(values + i);
+        __m256 value2 = _mm256_loadu_ps(values + i + 8);
+
+        low = _mm256_add_ps(low, _mm256_mul_ps(value1, value1));
+        high = _mm256_add_ps(high, _mm256_mul_ps(value2, value2));
+    }
+
+    float4 lanes[SUM_LANES];
+    _mm256_storeu_ps(lanes, low);
+    _mm256_storeu_ps(lanes + 8, high);
+
+    for(; i < count; i++)
+        lanes[i % SUM_LANES] += values[i] * values[i];
+
+    return reduce_lanes(lanes, SUM_LANES);
+}
+
+
+__attribute__((target("avx2")))
+static float4 max_avx2(const float4 *values, int count)
+{
+    /* _mm256_max_ps() returns the second operand if any of them is NaN */
+    __m256 max = _mm256_setzero_ps();
+    int i = 0;
+
+    for(; i + 8 <= count; i += 8)
+        max = _mm256_max_ps(_mm256_loadu_ps(values + i), max);
+
+    float4 lanes[8];
+    _mm256_storeu_ps(lanes, max);
+
+    return Max(max_scalar(lanes, 8), max_scalar(values + i, count - i));
+}
+
+
+/*
+ * Each block of the first vector is compared with all rotations of the block of the second vector, so all matching
+ * pairs of the two blocks are found. The block whose last index is lower is replaced by the next one, or both of them
+ * if their last indices are equal. The indices of each vector are unique, so each pair is found exactly once.
+ */
+__attribute__((target("avx2")))
+static float4 sparse_dot_avx2(const int32 *indices1, const float4 *values1, int count1, const int32 *indices2,
+        const float4 *values2, int count2)
+{
+    __m256 sum = _mm256_setzero_ps();
+    __m256i rotate = _mm256_setr_epi32(1, 2, 3, 4, 5, 6, 7, 0);
+    int i = 0;
+    int j = 0;
+
+    while(i + DOT_LANES <= count1 && j + DOT_LANES <= count2)
+    {
+        __m256i index1 = _mm256_loadu_si256((const __m256i *) (indices1 + i));
+        __m256i index2 = _mm256_loadu_si256((const __m256i *) (indices2 + j));
+        __m256 value1 = _mm256_loadu_ps(values1 + i);
+        __m256 value2 = _mm256_loadu_ps(values2 + j);
+
+        for(int r = 0; r < DOT_LANES; r++)
+        {
+            __m256 match = _mm256_castsi256_ps(_mm256_cmpeq_epi32(index1, index2));
+            sum = _mm256_add_ps(sum, _mm256_and_ps(match, _mm256_mul_ps(value1, value2)));
+
+            index2 = _mm256_permutevar8x32_epi32(index2, rotate);
+            value2 = _mm256_permutevar8x32_ps(value2, rotate);
+        }
+
+        int32 last1 = indices1[i + DOT_LANES - 1];
+        int32 last2 = indices2[j + DOT_LANES - 1];
+
+        if(last1 <= last2)
+            i += DOT_LANES;
+
+        if(last2 <= last1)
+            j += DOT_LANES;
+    }
+
+    float4 lanes[DOT_LANES];
+    _mm256_storeu_ps(lanes, sum);
+
+    return reduce_lanes(lanes, DOT_LANES) + sparse_dot_tail(indices1, values1, i, count1, indices2, values2, j, count2);
+}
+
+
+__attribute__((target("avx512f")))
+static int skip_below_avx512(const float4 *values, int start, int count, float4 bound)
+{
+    __m512 limit = _mm512_set1_ps(bound);
+    int i = start;
+
+    for(; i + 16 <= count; i += 16)
+    {
+        __mmask16 mask = _mm512_cmp_ps_mask(_mm512_loadu_ps(values + i), limit, _CMP_LT_OQ);
+
+        if(mask != 0xFFFF)
+            return i + __builtin_ctz(~mask & 0xFFFF);
+    }
+
+    return skip_below_scalar(values, i, count, bound);
+}
+
+
+__attribute__((target("avx512f")))
+static float4 sum_squares_avx512(const float4 *values, int count)
+{
+    __m512 sum = _mm512_setzero_ps();
+    int i = 0;
+
+    for(; i + SUM_LANES <= count; i += SUM_LANES)
+    {
+        __m512 value = _mm512_loadu_ps(values + i);
+        sum = _mm512_add_ps(sum, _mm512_mul_ps(value, value));
+    }
+
+    float4 lanes[SUM_LANES];
+    _mm512_storeu_ps(lanes, sum);
+
+    for(; i < count; i++)
+        lanes[i % SUM_LANES] += values[i] * values[i];
+
+    return reduce_lanes(lanes, SUM_LANES);
+}
+
+
+__attribute__((target("avx512f")))
+static float4 max_avx512(const float4 *values, int count)
+{
+    __m512 max = _mm512_setzero_ps();
+    int i = 0;
+
+    for(; i + 16 <= count; i += 16)
+        max = _mm512_max_ps(_mm512_loadu_ps(values + i), max);
+
+    float4 lanes[16];
+    _mm512_storeu_ps(lanes, max);
+
+    return Max(max_scalar(lanes, 16), max_scalar(values + i, count - i));
+}
+
+#endif
+
+
+SimdKernels simd = { "scalar", skip_below_scalar, sum_squares_scalar, max_scalar, sparse_dot_scalar };
+
+
+void simd_init(void)
+{
+#ifdef USE_X86_SIMD
+    __builtin_cpu_init();
+
+    if(__builtin_cpu_supports("avx512f"))
+        simd = (SimdKernels) { "avx512", skip_below_avx512, sum_squares_avx512, max_avx512, sparse_dot_avx2 };
+    else if(__builtin_cpu_supports("avx2"))
+        simd = (SimdKernels) { "avx2", skip_below_avx2, sum_squares_avx2, max_avx2, sparse_dot_avx2 };
+#endif
+
+    elog(DEBUG1, "pgms: using %s kernels", simd.name);
+}
@@ -0,0 +1,56 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SRC_SIMD_H_
+#define SRC_SIMD_H_
+
+#include <postgres.h>
+
+
+/*
+ * Kernels of the innermost loops over float4 arrays. The best version supported by the CPU is selected by simd_init()
+ * when the library is loaded, the portable scalar versions are used until then and on other architectures.
+ *
+ * skip_below   - returns the index of the first value not lower than the bound, starting at the given index; values
+ *                have to be sorted, count is returned if there is no such value
+ * sum_squares  - returns the sum of squares of the values
+ * max          - returns the maximum of zero and the values, NaN values are ignored
+ * sparse_dot   - returns the dot product of two sparse vectors given by their indices and values; indices have to be
+ *                sorted and unique
+ *
+ * All versions of sum_squares and sparse_dot add the values in the same order, so the results do not depend on
+ * the CPU. The AVX-512 kernels use the AVX2 version of sparse_dot.
+ */
+typedef struct
+{
+    const char *name;
+    int (*skip_below)(const float4 *values, int start, int count, float4 bound);
+    float4 (*sum_squares)(const float4 *values, int count);
+    float4 (*max)(const float4 *values, int count);
+    float4 (*sparse_dot)(const int32 *indices1, const float4 *values1, int count1, const int32 *indices2,
+            const float4 *values2, int count2);
+}
+SimdKernels;
+
+
+extern SimdKernels simd;
+
+void simd_init(void);
+
+#endif /* SRC_SIMD_H_ */
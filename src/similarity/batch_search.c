@@ -0,0 +1,364 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <funcapi.h>
+#include <math.h>
+#include <miscadmin.h>
+#include <access/table.h>
+#include <access/tableam.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_class.h>
+#include <executor/tuptable.h>
+#include <utils/acl.h>
+#include <utils/array.h>
+#include <utils/lsyscache.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+#include <utils/rls.h>
+#include <utils/snapmgr.h>
+#include <utils/tuplestore.h>
+#include "similarity/cosine.h"
+#include "similarity/scratch.h"
+#include "enum.h"
+#include "simd.h"
+
+
+static bool initialized = false;
+static Oid cosine_greedy_oid;
+static Oid cosine_hungarian_oid;
+
+
+static void init()
+{
+    if(likely(initialized))
+        return;
+
+    Oid spaceid = LookupExplicitNamespace("pgms", false);
+    Oid typoid = LookupExplicitEnumType(spaceid, "similarity_method");
+    cosine_greedy_oid = LookupExplicitEnumValue(typoid, "COSINE_GREEDY");
+    cosine_hungarian_oid = LookupExplicitEnumValue(typoid, "COSINE_HUNGARIAN");
+
+    initialized = true;
+}
+
+
+/*
+ * Index of the peaks of all query spectra ordered by m/z values. The library spectra are matched against the queries
+ * by sweeping the index, so only the queries sharing a peak within the tolerance with the library spectrum are scored.
+ */
+typedef struct
+{
+    float4 *mz;
+    int *owner;
+    int count;
+}
+QueryIndex;
+
+
+typedef struct
+{
+    float4 mz;
+    int owner;
+}
+QueryPeak;
+
+
+static int query_peak_cmp(const void *a, const void *b)
+{
+    float4 mz1 = ((const QueryPeak *) a)->mz;
+    float4 mz2 = ((const QueryPeak *) b)->mz;
+
+    return (mz1 > mz2) - (mz1 < mz2);
+}
+
+
+static void query_index_build(QueryIndex *index, const WeightedSpectrum *queries, int count)
+{
+    int total = 0;
+
+    for(int i = 0; i < count; i++)
+        total += queries[i].spectrum.count;
+
+    QueryPeak *peaks = palloc(Max(total, 1) * sizeof(QueryPeak));
+    int position = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        SpectrumCursor cursor;
+
+        for(spectrum_cursor_init(&cursor, &queries[i].spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+            peaks[position++] = (QueryPeak) { cursor.mz, i };
+    }
+
+    qsort(peaks, total, sizeof(QueryPeak), query_peak_cmp);
+
+    index->mz = palloc(Max(total, 1) * sizeof(float4));
+    index->owner = palloc(Max(total, 1) * sizeof(int));
+    index->count = total;
+
+    for(int i = 0; i < total; i++)
+    {
+        index->mz[i] = peaks[i].mz;
+        index->owner[i] = peaks[i].owner;
+    }
+
+    pfree(peaks);
+}
+
+
+/*
+ * Collects the queries that have a peak within the tolerance of some peak of the library spectrum. The windows are
+ * widened slightly like in spectrum_may_have_peak(), because the kernels compute them from the other side. The stamps
+ * mark the queries already collected for the current library spectrum. Returns the number of the candidates.
+ */
+static int query_index_candidates(const QueryIndex *index, const Spectrum *spectrum, float tolerance, uint32 *stamps,
+        uint32 stamp, int *candidates)
+{
+    if(spectrum->count == 0 || index->count == 0)
+        return 0;
+
+    /* the margin is constant for the whole spectrum, so the low bounds of the windows are not decreasing */
+    double margin = (Max(fabs(spectrum_mz_min(spectrum)), fabs(spectrum_mz_max(spectrum))) + fabs(tolerance)) * 1e-6;
+    int found = 0;
+    int lowest = 0;
+
+    SpectrumCursor peak;
+
+    for(spectrum_cursor_init(&peak, spectrum); spectrum_cursor_valid(&peak); spectrum_cursor_next(&peak))
+    {
+        float4 low_bound = (double) peak.mz - tolerance - margin;
+        float4 high_bound = (double) peak.mz + tolerance + margin;
+
+        lowest = simd.skip_below(index->mz, lowest, index->count, low_bound);
+
+        for(int i = lowest; i < index->count && index->mz[i] <= high_bound; i++)
+        {
+            int owner = index->owner[i];
+
+            if(stamps[owner] != stamp)
+            {
+                stamps[owner] = stamp;
+                candidates[found++] = owner;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+/*
+ * Scores all query spectra against the spectra stored in the given column of the library table and returns
+ * the triples (query_idx, ctid, score) of the pairs whose score reaches the threshold. The library is read only once
+ * and each library spectrum is scored only against the queries selected by the index of their peaks, the scores
+ * are computed by the bounded kernels that give up as soon as the threshold cannot be reached.
+ */
+PG_FUNCTION_INFO_V1(batch_search);
+Datum batch_search(PG_FUNCTION_ARGS)
+{
+    ArrayType *array = PG_GETARG_ARRAYTYPE_P(0);
+    Oid relid = PG_GETARG_OID(1);
+    Name column = PG_GETARG_NAME(2);
+    Oid method = PG_GETARG_OID(3);
+    float tolerance = PG_GETARG_FLOAT4(4);
+    float threshold = PG_GETARG_FLOAT4(5);
+
+    init();
+
+    if(method != cosine_greedy_oid && method != cosine_hungarian_oid)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("unsupported similarity method")));
+
+    if(ARR_NDIM(array) > 1)
+        ereport(ERROR, (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR), errmsg("array of queries must be one-dimensional")));
+
+
+    ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    if(!rsi || !IsA(rsi, ReturnSetInfo))
+        ereport(ERROR,(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("set-valued function called in context that cannot accept a set")));
+
+    if(!(rsi->allowedModes & SFRM_Materialize))
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("materialize mode required, but it is not allowed in this context")));
+
+    rsi->returnMode = SFRM_Materialize;
+
+
+    Relation rel = table_open(relid, AccessShareLock);
+
+    if(rel->rd_rel->relkind != RELKIND_RELATION && rel->rd_rel->relkind != RELKIND_MATVIEW)
+        ereport(ERROR, (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                errmsg("\"%s\" is not a table or materialized view", RelationGetRelationName(rel))));
+
+    AttrNumber attnum = get_attnum(relid, NameStr(*column));
+
+    /* system columns have negative numbers */
+    if(attnum <= 0 || TupleDescAttr(RelationGetDescr(rel), attnum - 1)->attisdropped)
+        ereport(ERROR, (errcode(ERRCODE_UNDEFINED_COLUMN),
+                errmsg("column \"%s\" of relation \"%s\" does not exist", NameStr(*column), RelationGetRelationName(rel))));
+
+    if(TupleDescAttr(RelationGetDescr(rel), attnum - 1)->atttypid != ARR_ELEMTYPE(array))
+        ereport(ERROR, (errcode(ERRCODE_DATATYPE_MISMATCH),
+                errmsg("column \"%s\" of relation \"%s\" is not of type spectrum", NameStr(*column), RelationGetRelationName(rel))));
+
+    if(pg_class_aclcheck(relid, GetUserId(), ACL_SELECT) != ACLCHECK_OK &&
+            pg_attribute_aclcheck(relid, attnum, GetUserId(), ACL_SELECT) != ACLCHECK_OK)
+        ereport(ERROR, (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                errmsg("permission denied for column \"%s\" of relation \"%s\"", NameStr(*column), RelationGetRelationName(rel))));
+
+    /* the scan below does not apply row level security policies */
+    if(check_enable_rls(relid, InvalidOid, false) == RLS_ENABLED)
+        ereport(ERROR, (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("batch search is not supported for relation \"%s\" with row level security", RelationGetRelationName(rel))));
+
+
+    int16 typlen;
+    bool typbyval;
+    char typalign;
+    get_typlenbyvalalign(ARR_ELEMTYPE(array), &typlen, &typbyval, &typalign);
+
+    Datum *elements;
+    bool *nulls;
+    int count;
+    deconstruct_array(array, ARR_ELEMTYPE(array), typlen, typbyval, typalign, &elements, &nulls, &count);
+
+    int lbound = ARR_NDIM(array) > 0 ? ARR_LBOUND(array)[0] : 1;
+    WeightedSpectrum *queries = palloc(Max(count, 1) * sizeof(WeightedSpectrum));
+    int *subscripts = palloc(Max(count, 1) * sizeof(int));
+    int valid = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        if(nulls[i])
+            continue;
+
+        weighted_spectrum_open(&queries[valid], PG_DETOAST_DATUM(elements[i]), POWER_PRODUCT, 1, 0,
+                CurrentMemoryContext);
+        subscripts[valid++] = lbound + i;
+    }
+
+    QueryIndex index;
+    query_index_build(&index, queries, valid);
+
+    uint32 *stamps = palloc0(Max(valid, 1) * sizeof(uint32));
+    int *candidates = palloc(Max(valid, 1) * sizeof(int));
+    uint32 stamp = 0;
+
+
+    MemoryContext tmp_cxt = AllocSetContextCreate(CurrentMemoryContext, "batch search temporary cxt", ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_cxt = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+    TupleDesc tupdesc;
+
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    Tuplestorestate *tuple_store = tuplestore_begin_heap(rsi->allowedModes & SFRM_Materialize_Random, false, work_mem);
+    MemoryContextSwitchTo(old_cxt);
+
+    TableScanDesc scan = table_beginscan(rel, GetActiveSnapshot(), 0, NULL);
+    TupleTableSlot *slot = table_slot_create(rel, NULL);
+
+    while(table_scan_getnextslot(scan, ForwardScanDirection, slot))
+    {
+        CHECK_FOR_INTERRUPTS();
+
+        bool isnull;
+        Datum datum = slot_getattr(slot, attnum, &isnull);
+
+        if(isnull)
+            continue;
+
+        /* use the tmp context so we can clean up after each library spectrum is done */
+        MemoryContext old_cxt = MemoryContextSwitchTo(tmp_cxt);
+
+        WeightedSpectrum library;
+        weighted_spectrum_open(&library, PG_DETOAST_DATUM(datum), POWER_PRODUCT, 1, 0, NULL);
+
+        /* every pair reaches a threshold that is not positive, even if the spectra share no peak */
+        int found = valid;
+
+        if(threshold > 0)
+        {
+            if(++stamp == 0)
+            {
+                memset(stamps, 0, valid * sizeof(uint32));
+                stamp = 1;
+            }
+
+            found = query_index_candidates(&index, &library.spectrum, tolerance, stamps, stamp, candidates);
+        }
+
+        for(int i = 0; i < found; i++)
+        {
+            int query = threshold > 0 ? candidates[i] : i;
+            float score;
+            bool computed;
+
+            scratch_begin();
+
+            if(method == cosine_greedy_oid)
+                computed = greedy_bounded_score(&library, &queries[query], tolerance, threshold, &score);
+            else
+                computed = hungarian_bounded_score(&library, &queries[query], tolerance, threshold, &score);
+
+            if(!computed)
+                continue;
+
+            if(isfinite(score) && score < 0)
+                score = 0;
+            else if(isfinite(score) && score > 1)
+                score = 1;
+            else if(!isfinite(score))
+                score = NAN;
+
+            if(isnan(score) || !(score >= threshold))
+                continue;
+
+            Datum values[3];
+            bool isnulls[3] = { false, false, false };
+
+            values[0] = Int32GetDatum(subscripts[query]);
+            values[1] = PointerGetDatum(&slot->tts_tid);
+            values[2] = Float4GetDatum(score);
+
+            tuplestore_putvalues(tuple_store, tupdesc, values, isnulls);
+        }
+
+        /* clean up and switch back */
+        MemoryContextSwitchTo(old_cxt);
+        MemoryContextReset(tmp_cxt);
+    }
+
+    ExecDropSingleTupleTableSlot(slot);
+    table_endscan(scan);
+    table_close(rel, AccessShareLock);
+
+    rsi->setResult = tuple_store;
+    rsi->setDesc = tupdesc;
+
+
+    MemoryContextDelete(tmp_cxt);
+    PG_RETURN_NULL();
+}
@@ -0,0 +1,173 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include "similarity/cache.h"
+
+
+#define CACHED_ARGUMENTS    2
+
+
+typedef struct
+{
+    bool stable;
+    bool valid;
+    PowerKind kind;
+    float4 intensity_power;
+    float4 mz_power;
+    void *raw;              /* the copy of the undetoasted value, or NULL if it cannot be compared */
+    WeightedSpectrum spectrum;
+}
+CachedArgument;
+
+
+typedef struct
+{
+    CachedArgument arguments[CACHED_ARGUMENTS];
+}
+ArgumentCache;
+
+
+static ArgumentCache *get_argument_cache(FunctionCallInfo fcinfo)
+{
+    FmgrInfo *flinfo = fcinfo->flinfo;
+
+    if(flinfo == NULL || flinfo->fn_expr == NULL)
+        return NULL;
+
+    if(flinfo->fn_extra == NULL)
+    {
+        ArgumentCache *cache = MemoryContextAllocZero(flinfo->fn_mcxt, sizeof(ArgumentCache));
+
+        for(int i = 0; i < CACHED_ARGUMENTS; i++)
+            cache->arguments[i].stable = get_fn_expr_arg_stable(flinfo, i);
+
+        flinfo->fn_extra = cache;
+    }
+
+    return (ArgumentCache *) flinfo->fn_extra;
+}
+
+
+/*
+ * Returns a copy of the undetoasted value of the datum allocated in the given context. The inline values and
+ * the on-disk TOAST pointers identify the value, so they can be compared instead of the detoasted values. Other
+ * external values refer to memory, so NULL is returned for them.
+ */
+static void *raw_copy(Datum datum, MemoryContext context)
+{
+    struct varlena *value = (struct varlena *) DatumGetPointer(datum);
+
+    if(VARATT_IS_EXTERNAL(value) && !VARATT_IS_EXTERNAL_ONDISK(value))
+        return NULL;
+
+    void *copy = MemoryContextAlloc(context, VARSIZE_ANY(value));
+    memcpy(copy, value, VARSIZE_ANY(value));
+
+    return copy;
+}
+
+
+static inline bool raw_equal(const void *raw, Datum datum)
+{
+    const void *value = DatumGetPointer(datum);
+
+    return raw != NULL && VARSIZE_ANY(raw) == VARSIZE_ANY(value) && memcmp(raw, value, VARSIZE_ANY(value)) == 0;
+}
+
+
+const WeightedSpectrum *similarity_argument(FunctionCallInfo fcinfo, int argno, PowerKind kind, float4 intensity_power,
+        float4 mz_power, WeightedSpectrum *buffer)
+{
+    Datum datum = PG_GETARG_DATUM(argno);
+    ArgumentCache *cache = argno < CACHED_ARGUMENTS ? get_argument_cache(fcinfo) : NULL;
+
+    if(cache == NULL || !cache->arguments[argno].stable)
+    {
+        weighted_spectrum_open(buffer, PG_DETOAST_DATUM(datum), kind, intensity_power, mz_power, NULL);
+        return buffer;
+    }
+
+    CachedArgument *argument = &cache->arguments[argno];
+
+    /*
+     * The address of an external parameter can be reused for a different value, so the content has to be compared.
+     * The undetoasted values are compared first, so that the value given by a TOAST pointer is not fetched for each
+     * call. The value is detoasted only if they differ.
+     */
+    if(argument->valid && argument->kind == kind && argument->intensity_power == intensity_power &&
+            argument->mz_power == mz_power)
+    {
+        if(raw_equal(argument->raw, datum))
+            return &argument->spectrum;
+
+        void *value = PG_DETOAST_DATUM(datum);
+        bool equal = VARSIZE(argument->spectrum.value) == VARSIZE(value) &&
+                memcmp(argument->spectrum.value, value, VARSIZE(value)) == 0;
+
+        if((Pointer) value != DatumGetPointer(datum))
+            pfree(value);
+
+        if(equal)
+        {
+            if(argument->raw != NULL)
+                pfree(argument->raw);
+
+            argument->raw = raw_copy(datum, fcinfo->flinfo->fn_mcxt);
+            return &argument->spectrum;
+        }
+    }
+
+    if(argument->valid)
+    {
+        if(argument->spectrum.weights != NULL)
+            pfree((void *) argument->spectrum.weights);
+
+        if(argument->raw != NULL)
+            pfree(argument->raw);
+
+        pfree((void *) argument->spectrum.value);
+        argument->valid = false;
+    }
+
+    MemoryContext old_cxt = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+    void *value = PG_DETOAST_DATUM_COPY(datum);
+    MemoryContextSwitchTo(old_cxt);
+
+    weighted_spectrum_open(&argument->spectrum, value, kind, intensity_power, mz_power, fcinfo->flinfo->fn_mcxt);
+    argument->raw = raw_copy(datum, fcinfo->flinfo->fn_mcxt);
+    argument->kind = kind;
+    argument->intensity_power = intensity_power;
+    argument->mz_power = mz_power;
+    argument->valid = true;
+
+    return &argument->spectrum;
+}
+
+
+void similarity_argument_free(FunctionCallInfo fcinfo, int argno, const WeightedSpectrum *spectrum,
+        const WeightedSpectrum *buffer)
+{
+    if(spectrum == buffer && spectrum->value != DatumGetPointer(PG_GETARG_DATUM(argno)))
+        pfree((void *) spectrum->value);
+}
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <postgres.h>
+#include <fmgr.h>
+#include "similarity/cosine.h"
+
+
+/*
+ * Returns the spectrum argument of a similarity function weighted by the given powers. The spectra given by arguments
+ * that are stable during the scan (constants and external parameters, typically the query spectrum) are detoasted and
+ * weighted only once and kept in fn_extra, the cache is refreshed if the content of the argument or the powers change.
+ * Other spectra are weighted into the buffer using the scratch arena, so scratch_begin() has to be called before.
+ */
+const WeightedSpectrum *similarity_argument(FunctionCallInfo fcinfo, int argno, PowerKind kind, float4 intensity_power,
+        float4 mz_power, WeightedSpectrum *buffer);
+
+/*
+ * Releases the detoasted copy of an argument returned by similarity_argument(), cached spectra are kept.
+ */
+void similarity_argument_free(FunctionCallInfo fcinfo, int argno, const WeightedSpectrum *spectrum,
+        const WeightedSpectrum *buffer);
+
+#endif /* CACHE_H */
@@ -24,45 +24,383 @@
 #define COSINE_H
 
 #include <math.h>
+#include "spectrum.h"
+#include "similarity/scratch.h"
 
 
-static inline float calc_score(const float intensity1, const float intensity2, const float mz1, const float mz2, const float intensity_power, const float mz_power)
+/*
+ * The score of a pair of peaks is the product of their weights, where the weight of a peak is
+ * mz^mz_power * intensity^intensity_power. The weights are computed once per spectrum, and they are not stored at all
+ * for the default powers, where they are equal to the intensities. The kind of powers selects how the weights are
+ * computed, powf() is called only if there is no exact alternative. The weights of the entropy kinds are
+ * the intensities transformed for the entropy similarity by calc_entropy_weights(), they do not use the powers, only
+ * the weighted kind with a given entropy takes the entropy as intensity_power.
+ */
+typedef enum
+{
+    POWER_PRODUCT,      /* mz_power = 0, intensity_power = 1 */
+    POWER_SQRT,         /* mz_power = 0, intensity_power = 0.5 */
+    POWER_INTENSITY,    /* mz_power = 0 */
+    POWER_GENERIC,
+    POWER_ENTROPY,      /* intensities normalized to the unit sum */
+    POWER_ENTROPY_WEIGHTED,
+    POWER_ENTROPY_GIVEN     /* POWER_ENTROPY_WEIGHTED with the entropy given by intensity_power */
+}
+PowerKind;
+
+
+/*
+ * Spectrum together with the weights of its peaks and its norm (the sum of squared weights).
+ */
+typedef struct
+{
+    Spectrum spectrum;
+    const void *value;
+    const float4 *weights;  /* NULL for the default powers */
+    float4 norm;
+}
+WeightedSpectrum;
+
+
+static inline PowerKind power_kind(const float intensity_power, const float mz_power)
 {
     if(mz_power == 0 && intensity_power == 1)
-        return intensity1 * intensity2;
+        return POWER_PRODUCT;
+    else if(mz_power == 0 && intensity_power == 0.5f)
+        return POWER_SQRT;
     else if(mz_power == 0)
-        return powf(intensity1 * intensity2, intensity_power);
+        return POWER_INTENSITY;
     else
-        return powf(mz1 * mz2, mz_power) * powf(intensity1 * intensity2, intensity_power);
+        return POWER_GENERIC;
 }
 
 
-static inline float calc_norm(const float const *restrict intensities, const float const *restrict mz, const uint len, const float intensity_power, const float mz_power)
+static inline float calc_weight(const PowerKind kind, const float intensity, const float mz,
+        const float intensity_power, const float mz_power)
 {
+    switch(kind)
+    {
+        case POWER_PRODUCT:
+            return intensity;
+        case POWER_SQRT:
+            return sqrtf(intensity);
+        case POWER_INTENSITY:
+            return powf(intensity, intensity_power);
+        default:
+            return powf(mz, mz_power) * powf(intensity, intensity_power);
+    }
+}
+
+
+static inline float calc_simple_norm(const Spectrum *spectrum)
+{
+    if(spectrum->header)
+        return spectrum->header->norm;
+
+    if(spectrum->intensity)
+        return simd.sum_squares(spectrum->intensity, spectrum->count);
+
     float result = 0;
 
-    for(uint i = 0; i < len; i++)
+    for(int i = 0; i < spectrum->count; i++)
     {
-        if(mz_power == 0 && intensity_power == 1)
-            result += intensities[i] * intensities[i];
-        else if(mz_power == 0)
-            result += powf(intensities[i], 2 * intensity_power);
-        else
-            result += powf(mz[i], 2 * mz_power) * powf(intensities[i], 2 * intensity_power);
+        float intensity = spectrum_intensity(spectrum, i);
+        result += intensity * intensity;
     }
 
     return result;
 }
 
 
-static inline float calc_simple_norm(float *restrict spec_intensities, int len)
+/*
+ * Returns the spectral entropy of the intensities normalized to the unit sum.
+ */
+static inline double calc_entropy(const Spectrum *spectrum)
 {
-    float result = 0;
+    double sum = 0;
+    double entropy = 0;
 
-    for(int i = 0; i < len; i++)
-        result += spec_intensities[i] * spec_intensities[i];
+    for(int i = 0; i < spectrum->count; i++)
+        sum += spectrum_intensity(spectrum, i);
 
-    return result;
+    if(sum == 0)
+        return 0;
+
+    for(int i = 0; i < spectrum->count; i++)
+    {
+        double intensity = spectrum_intensity(spectrum, i) / sum;
+
+        if(intensity != 0)
+            entropy -= intensity * log(intensity);
+    }
+
+    return entropy;
+}
+
+
+/*
+ * Returns the power of intensities used by the weighted entropy similarity, the intensities of spectra with
+ * the entropy lower than 3 are raised to the power of 0.25 + 0.25 * entropy, so that the low intensity peaks of simple
+ * spectra are not neglected.
+ */
+static inline double entropy_power(double entropy)
+{
+    return entropy < 3 ? 0.25 + 0.25 * entropy : 1;
+}
+
+
+/*
+ * Computes the intensities used by the entropy similarity (Li et al., Nat. Methods 18, 1524-1531, 2021). The
+ * intensities are raised to the given power and normalized to the unit sum. Returns the sum of squared weights.
+ */
+static inline float calc_entropy_weights(const Spectrum *spectrum, double power, float4 *weights)
+{
+    double sum = 0;
+
+    for(int i = 0; i < spectrum->count; i++)
+    {
+        double intensity = spectrum_intensity(spectrum, i);
+        sum += power == 1 ? intensity : pow(intensity, power);
+    }
+
+    float4 norm = 0;
+
+    for(int i = 0; i < spectrum->count; i++)
+    {
+        double intensity = spectrum_intensity(spectrum, i);
+        float4 weight = 0;
+
+        if(sum != 0)
+            weight = (power == 1 ? intensity : pow(intensity, power)) / sum;
+
+        weights[i] = weight;
+        norm += weight * weight;
+    }
+
+    return norm;
+}
+
+
+/*
+ * Opens the detoasted spectrum value and computes its weights and its norm. The weights are allocated in the given
+ * memory context, or they are taken from the scratch arena if the context is NULL.
+ */
+static inline void weighted_spectrum_open(WeightedSpectrum *result, const void *value, const PowerKind kind,
+        const float intensity_power, const float mz_power, MemoryContext context)
+{
+    spectrum_open(&result->spectrum, value);
+    result->value = value;
+
+    if(kind == POWER_PRODUCT)
+    {
+        result->weights = NULL;
+        result->norm = calc_simple_norm(&result->spectrum);
+        return;
+    }
+
+    int count = result->spectrum.count;
+    size_t size = Max(count, 1) * sizeof(float4);
+    float4 *weights = context ? MemoryContextAlloc(context, size) : scratch_alloc(size);
+
+    if(kind == POWER_ENTROPY || kind == POWER_ENTROPY_WEIGHTED || kind == POWER_ENTROPY_GIVEN)
+    {
+        double power = 1;
+
+        /* the entropy is rounded as by spectrum_entropy(), so the weights do not depend on how it is obtained */
+        if(kind == POWER_ENTROPY_WEIGHTED)
+            power = entropy_power((float4) calc_entropy(&result->spectrum));
+        else if(kind == POWER_ENTROPY_GIVEN)
+            power = entropy_power(intensity_power);
+
+        result->weights = weights;
+        result->norm = calc_entropy_weights(&result->spectrum, power, weights);
+        return;
+    }
+
+    float4 norm = 0;
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &result->spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        float4 weight = calc_weight(kind, spectrum_intensity(&result->spectrum, cursor.index), cursor.mz,
+                intensity_power, mz_power);
+
+        weights[cursor.index] = weight;
+        norm += weight * weight;
+    }
+
+    result->weights = weights;
+    result->norm = norm;
 }
 
+
+static inline float4 spectrum_weight(const WeightedSpectrum *spectrum, int index)
+{
+    if(spectrum->weights != NULL)
+        return spectrum->weights[index];
+
+    return spectrum_intensity(&spectrum->spectrum, index);
+}
+
+
+/*
+ * Greedy merge of the peaks of two spectra used by the cosine greedy score. Each peak of the first spectrum is matched
+ * to the first peak of the second spectrum within the tolerance that follows the previously matched one. The matched
+ * pairs are returned by greedy_merge_next() in the order of the peaks of the first spectrum.
+ */
+typedef struct
+{
+    SpectrumCursor peak1;
+    SpectrumCursor peak2;
+    float tolerance;
+    int index1;
+    int index2;
+}
+GreedyMerge;
+
+
+static inline void greedy_merge_init(GreedyMerge *merge, const Spectrum *spectrum1, const Spectrum *spectrum2,
+        float tolerance)
+{
+    spectrum_cursor_init(&merge->peak1, spectrum1);
+    spectrum_cursor_init(&merge->peak2, spectrum2);
+    merge->tolerance = tolerance;
+}
+
+
+static inline bool greedy_merge_next(GreedyMerge *merge)
+{
+    SpectrumCursor *peak1 = &merge->peak1;
+    SpectrumCursor *peak2 = &merge->peak2;
+
+    for(; spectrum_cursor_valid(peak1); spectrum_cursor_next(peak1))
+    {
+        float low_bound = peak1->mz - merge->tolerance;
+        float high_bound = peak1->mz + merge->tolerance;
+
+        /* peaks below both bounds are skipped by the loop below also for negative tolerances */
+        spectrum_cursor_skip(peak2, Min(low_bound, high_bound));
+
+        for(; spectrum_cursor_valid(peak2); spectrum_cursor_next(peak2))
+        {
+            if(peak2->mz > high_bound)
+                break;
+
+            if(peak2->mz < low_bound)
+                continue;
+
+            merge->index1 = peak1->index;
+            merge->index2 = peak2->index;
+
+            spectrum_cursor_next(peak1);
+            spectrum_cursor_next(peak2);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/*
+ * Upper bounds of the cosine score used to reject pairs of spectra by a threshold. The bounds are valid for the default
+ * powers only. The norms are inflated by BOUND_SLACK, so rounding errors of the scores and of the norms stored in
+ * headers cannot cause a false rejection.
+ */
+#define BOUND_SLACK     1e-3
+
+
+/*
+ * Tests whether the spectrum can have a peak within the tolerance of the given m/z value. The window is widened
+ * slightly, because the kernels compute it from the other side. Only the m/z range is tested for compact spectra.
+ */
+static inline bool spectrum_may_have_peak(const Spectrum *spectrum, float mz, float tolerance)
+{
+    double margin = (fabs(mz) + fabs(tolerance)) * 1e-6;
+    double low_bound = (double) mz - tolerance - margin;
+    double high_bound = (double) mz + tolerance + margin;
+
+    if(spectrum->count == 0 || spectrum_mz_max(spectrum) < low_bound || spectrum_mz_min(spectrum) > high_bound)
+        return false;
+
+    if(spectrum->mz == NULL)
+        return true;
+
+    int low = 0;
+    int high = spectrum->count;
+
+    while(low < high)
+    {
+        int middle = low + (high - low) / 2;
+
+        if(spectrum->mz[middle] < low_bound)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low < spectrum->count && spectrum->mz[low] <= high_bound;
+}
+
+
+static inline double unmatched_top_mass(const Spectrum *spectrum, const Spectrum *other, float tolerance, float shift)
+{
+    double mass = 0;
+
+    for(int i = 0; i < SPECTRUM_TOP_PEAKS; i++)
+    {
+        float mz = spectrum->header->top_mz[i];
+        float intensity = spectrum->header->top_intensity[i];
+
+        if(intensity == 0 || spectrum_may_have_peak(other, mz, tolerance))
+            continue;
+
+        if(shift != 0 && spectrum_may_have_peak(other, mz + shift, tolerance))
+            continue;
+
+        mass += (double) intensity * intensity;
+    }
+
+    return mass;
+}
+
+
+/*
+ * Returns an upper bound of the cosine score computed from the headers before any peaks are matched. By the
+ * Cauchy-Schwarz inequality, the score cannot exceed sqrt(M1 * M2 / (N1 * N2)), where N are the norms and M are
+ * the norms reduced by the top peaks that have no peak of the other spectrum within the tolerance. Peaks of the second
+ * spectrum are also matched after the shift is added to them. The trivial bound is returned for spectra without
+ * headers.
+ */
+static inline double calc_upper_bound(const Spectrum *spectrum1, const Spectrum *spectrum2, float tolerance,
+        float shift)
+{
+    if(spectrum1->header == NULL || spectrum2->header == NULL || isnan(tolerance) || isnan(shift))
+        return 1;
+
+    double norm1 = spectrum1->header->norm;
+    double norm2 = spectrum2->header->norm;
+    double mass1 = norm1 * (1 + BOUND_SLACK) - unmatched_top_mass(spectrum1, spectrum2, tolerance, -shift);
+    double mass2 = norm2 * (1 + BOUND_SLACK) - unmatched_top_mass(spectrum2, spectrum1, tolerance, shift);
+
+    return sqrt(Max(mass1, 0) * Max(mass2, 0) / (norm1 * norm2));
+}
+
+
+/*
+ * Score kernels for the default powers that give up as soon as the score cannot reach the threshold. The computed score
+ * is stored into the result and it is not clamped yet. They return false if the computation has been given up.
+ */
+bool greedy_bounded_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance,
+        float threshold, float *result);
+bool hungarian_bounded_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance,
+        float threshold, float *result);
+
+/*
+ * Computes the modified cosine score, the pairs of peaks matched directly or after the shift are assigned greedily.
+ * The score is not clamped yet.
+ */
+float modified_score(const WeightedSpectrum *reference, const WeightedSpectrum *query, float shift, float tolerance);
+
 #endif /* COSINE_H */
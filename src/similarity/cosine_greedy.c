@@ -26,63 +26,164 @@
 #endif
 #include <fmgr.h>
 #include <math.h>
+#include "pgms.h"
+#include "similarity/cache.h"
 #include "similarity/cosine.h"
+#include "similarity/pairs.h"
 
 
-PG_FUNCTION_INFO_V1(cosine_greedy);
-Datum cosine_greedy(PG_FUNCTION_ARGS)
+static float greedy_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance)
 {
-    void *spec1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    void *spec2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+        return 0;
 
-    int len1 = (VARSIZE(spec1) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz1 = (float4 *) VARDATA(spec1);
-    float *restrict intensities1 = mz1 + len1;
+    float score = 0;
 
-    int len2 = (VARSIZE(spec2) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz2 = (float4 *) VARDATA(spec2);
-    float *restrict intensities2 = mz2 + len2;
+    GreedyMerge merge;
+    greedy_merge_init(&merge, &spectrum1->spectrum, &spectrum2->spectrum, tolerance);
 
-    float tolerance = PG_GETARG_FLOAT4(2);
-    float mz_power = PG_GETARG_FLOAT4(3);
-    float intensity_power = PG_GETARG_FLOAT4(4);
+    while(greedy_merge_next(&merge))
+        score += spectrum_weight(spectrum1, merge.index1) * spectrum_weight(spectrum2, merge.index2);
 
+    if(score != 0)
+        score /= sqrtf(spectrum1->norm * spectrum2->norm);
 
-    int matches = 0;
-    int lowest_idx = 0;
-    float score = 0;
+    return score;
+}
+
+
+/*
+ * Computes the cosine greedy score in the same way as matchms, i.e. all pairs of peaks within the tolerance are
+ * collected in one pass and they are assigned greedily in the order of decreasing scores.
+ */
+static float matchms_greedy_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2,
+        float tolerance)
+{
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+        return 0;
+
+    PairBuffer pairs;
+    pair_buffer_init(&pairs, Max(spectrum1->spectrum.count, spectrum2->spectrum.count));
 
-    for(int peak1 = 0; peak1 < len1; peak1++)
+    SpectrumCursor peak1;
+    SpectrumCursor lowest;
+    spectrum_cursor_init(&lowest, &spectrum2->spectrum);
+
+    for(spectrum_cursor_init(&peak1, &spectrum1->spectrum); spectrum_cursor_valid(&peak1); spectrum_cursor_next(&peak1))
     {
-        float low_bound = mz1[peak1] - tolerance;
-        float high_bound = mz1[peak1] + tolerance;
+        float weight1 = spectrum_weight(spectrum1, peak1.index);
+        float high_bound = peak1.mz + tolerance;
+
+        spectrum_cursor_skip(&lowest, peak1.mz - tolerance);
 
-        for(int peak2 = lowest_idx; peak2 < len2; peak2++)
+        for(SpectrumCursor peak2 = lowest; spectrum_cursor_valid(&peak2); spectrum_cursor_next(&peak2))
         {
-            if(mz2[peak2] > high_bound)
+            if(peak2.mz > high_bound)
                 break;
 
-            lowest_idx = peak2 + 1;
+            pair_buffer_add(&pairs, peak1.index, peak2.index, weight1 * spectrum_weight(spectrum2, peak2.index));
+        }
+    }
+
+    if(pairs.count == 0)
+        return 0;
+
+    float score = greedy_assignment(&pairs, spectrum1->spectrum.count, spectrum2->spectrum.count);
+
+    if(score != 0)
+        score /= sqrtf(spectrum1->norm * spectrum2->norm);
+
+    return score;
+}
+
+
+/*
+ * Computes the cosine greedy score like greedy_score(), but gives up as soon as the score cannot reach the threshold.
+ * The rest of the score is bounded by the Cauchy-Schwarz inequality from the weight mass of the peaks of the first
+ * spectrum that have not been processed yet and of the peaks of the second spectrum that have not been matched yet.
+ * Returns false if the computation has been given up.
+ */
+bool greedy_bounded_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2,
+        float tolerance, float threshold, float *result)
+{
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+    {
+        *result = 0;
+        return true;
+    }
+
+    /* negative scores are clamped, so they can still pass negative thresholds */
+    bool bounded = threshold >= 0;
+
+    if(bounded && calc_upper_bound(&spectrum1->spectrum, &spectrum2->spectrum, tolerance, 0) < threshold)
+        return false;
+
+    double limit = threshold * sqrt((double) spectrum1->norm * spectrum2->norm);
+    double remaining1 = spectrum1->norm * (1 + BOUND_SLACK);
+    double remaining2 = spectrum2->norm * (1 + BOUND_SLACK);
+    float score = 0;
+
+    SpectrumCursor peak1;
+    SpectrumCursor peak2;
+    spectrum_cursor_init(&peak2, &spectrum2->spectrum);
 
-            if(mz2[peak2] < low_bound)
+    for(spectrum_cursor_init(&peak1, &spectrum1->spectrum); spectrum_cursor_valid(&peak1); spectrum_cursor_next(&peak1))
+    {
+        float weight1 = spectrum_weight(spectrum1, peak1.index);
+        float low_bound = peak1.mz - tolerance;
+        float high_bound = peak1.mz + tolerance;
+
+        /* peaks below both bounds are skipped by the loop below also for negative tolerances */
+        spectrum_cursor_skip(&peak2, Min(low_bound, high_bound));
+
+        for(; spectrum_cursor_valid(&peak2); spectrum_cursor_next(&peak2))
+        {
+            if(peak2.mz > high_bound)
+                break;
+
+            if(peak2.mz < low_bound)
                 continue;
 
-            matches++;
-            score += calc_score(intensities1[peak1], intensities2[peak2], mz1[peak1], mz2[peak2], intensity_power, mz_power);
+            float weight2 = spectrum_weight(spectrum2, peak2.index);
+            score += weight1 * weight2;
+            remaining2 -= (double) weight2 * weight2;
+
+            spectrum_cursor_next(&peak2);
             break;
         }
-    }
 
-    if(score !=0)
-    {
-        float norm1 = calc_norm(intensities1, mz1, len1, intensity_power, mz_power);
-        float norm2 = calc_norm(intensities2, mz2, len2, intensity_power, mz_power);
+        remaining1 -= (double) weight1 * weight1;
 
-        score /= sqrtf(norm1 * norm2);
+        /* score + sqrt(remaining1 * remaining2) < limit */
+        if(bounded && score < limit && remaining1 * remaining2 < (limit - score) * (limit - score))
+            return false;
     }
 
-    PG_FREE_IF_COPY(spec1, 0);
-    PG_FREE_IF_COPY(spec2, 1);
+    if(score != 0)
+        score /= sqrtf(spectrum1->norm * spectrum2->norm);
+
+    *result = score;
+    return true;
+}
+
+
+static float4 cosine_greedy_call(FunctionCallInfo fcinfo, float tolerance, float intensity_power, float mz_power,
+        bool matchms)
+{
+    PowerKind kind = power_kind(intensity_power, mz_power);
+
+    scratch_begin();
+
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, kind, intensity_power, mz_power, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, kind, intensity_power, mz_power, &buffer2);
+
+    float score = matchms ? matchms_greedy_score(spectrum1, spectrum2, tolerance) :
+            greedy_score(spectrum1, spectrum2, tolerance);
+
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
 
     if(isfinite(score) && score < 0)
         score = 0;
@@ -91,69 +192,121 @@ Datum cosine_greedy(PG_FUNCTION_ARGS)
     else if(!isfinite(score))
         score = NAN;
 
-    PG_RETURN_FLOAT4(score);
+    return score;
+}
+
+
+PG_FUNCTION_INFO_V1(cosine_greedy);
+Datum cosine_greedy(PG_FUNCTION_ARGS)
+{
+    float tolerance = PG_GETARG_FLOAT4(2);
+    float mz_power = PG_GETARG_FLOAT4(3);
+    float intensity_power = PG_GETARG_FLOAT4(4);
+
+    PG_RETURN_FLOAT4(cosine_greedy_call(fcinfo, tolerance, intensity_power, mz_power, false));
 }
 
 
 PG_FUNCTION_INFO_V1(cosine_greedy_simple);
 Datum cosine_greedy_simple(PG_FUNCTION_ARGS)
 {
-    void *spec1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    void *spec2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    float tolerance = PG_GETARG_FLOAT4(2);
 
-    int len1 = (VARSIZE(spec1) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz1 = (float4 *) VARDATA(spec1);
-    float *restrict intensities1 = mz1 + len1;
+    PG_RETURN_FLOAT4(cosine_greedy_call(fcinfo, tolerance, 1, 0, false));
+}
 
-    int len2 = (VARSIZE(spec2) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz2 = (float4 *) VARDATA(spec2);
-    float *restrict intensities2 = mz2 + len2;
 
+/*
+ * Computes the cosine greedy score with the same matching of peaks as matchms, the pairs of peaks are ranked by their
+ * scores instead of their m/z values.
+ */
+PG_FUNCTION_INFO_V1(cosine_greedy_matchms);
+Datum cosine_greedy_matchms(PG_FUNCTION_ARGS)
+{
     float tolerance = PG_GETARG_FLOAT4(2);
+    float mz_power = PG_GETARG_FLOAT4(3);
+    float intensity_power = PG_GETARG_FLOAT4(4);
 
+    PG_RETURN_FLOAT4(cosine_greedy_call(fcinfo, tolerance, intensity_power, mz_power, true));
+}
 
-    float score = 0;
-    int matches = 0;
-    int lowest_idx = 0;
 
-    for(int peak1 = 0; peak1 < len1; peak1++)
-    {
-        float low_bound = mz1[peak1] - tolerance;
-        float high_bound = mz1[peak1] + tolerance;
+/*
+ * Computes the bounded cosine greedy score for the default powers. Returns false if the score cannot reach
+ * the threshold, the score is clamped like by cosine_greedy() otherwise.
+ */
+static bool cosine_greedy_bounded_call(FunctionCallInfo fcinfo, float tolerance, float threshold, float *score)
+{
+    scratch_begin();
 
-        for(int peak2 = lowest_idx; peak2 < len2; peak2++)
-        {
-            if(mz2[peak2] > high_bound)
-                break;
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, POWER_PRODUCT, 1, 0, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, POWER_PRODUCT, 1, 0, &buffer2);
 
-            lowest_idx = peak2 + 1;
+    bool computed = greedy_bounded_score(spectrum1, spectrum2, tolerance, threshold, score);
 
-            if(mz2[peak2] < low_bound)
-                continue;
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
 
-            matches++;
-            score += intensities1[peak1] * intensities2[peak2];
-            break;
-        }
-    }
+    if(computed && isfinite(*score) && *score < 0)
+        *score = 0;
+    else if(computed && isfinite(*score) && *score > 1)
+        *score = 1;
+    else if(computed && !isfinite(*score))
+        *score = NAN;
 
-    if(score !=0)
-    {
-        float norm1 = calc_simple_norm(intensities1, len1);
-        float norm2 = calc_simple_norm(intensities2, len2);
+    return computed;
+}
 
-        score /= sqrtf(norm1 * norm2);
-    }
 
-    PG_FREE_IF_COPY(spec1, 0);
-    PG_FREE_IF_COPY(spec2, 1);
+/*
+ * Tests whether the cosine greedy score for the default powers exceeds the threshold, i.e. it is equivalent to
+ * cosine_greedy(spectrum1, spectrum2, tolerance) > threshold, but most of the spectra that do not pass the threshold
+ * are rejected without computing the score. Returns NULL if the score is not a number.
+ */
+PG_FUNCTION_INFO_V1(cosine_greedy_above);
+Datum cosine_greedy_above(PG_FUNCTION_ARGS)
+{
+    float tolerance = PG_GETARG_FLOAT4(2);
+    float threshold = PG_GETARG_FLOAT4(3);
 
-    if(isfinite(score) && score < 0)
-        score = 0;
-    else if(isfinite(score) && score > 1)
-        score = 1;
-    else if(!isfinite(score))
-        score = NAN;
+    float score;
+
+    if(!cosine_greedy_bounded_call(fcinfo, tolerance, threshold, &score))
+        PG_RETURN_BOOL(false);
+
+    if(isnan(score))
+        PG_RETURN_NULL();
+
+    PG_RETURN_BOOL(score > threshold);
+}
+
+
+/*
+ * Implements the % operator: the cosine greedy score of the spectra has to reach pgms.similarity_threshold, with the
+ * peaks matched using pgms.similarity_tolerance.
+ */
+PG_FUNCTION_INFO_V1(spectrum_similar);
+Datum spectrum_similar(PG_FUNCTION_ARGS)
+{
+    float score;
+
+    if(!cosine_greedy_bounded_call(fcinfo, similarity_tolerance, similarity_threshold, &score))
+        PG_RETURN_BOOL(false);
+
+    PG_RETURN_BOOL(score >= similarity_threshold);
+}
+
+
+/*
+ * Implements the <-> operator: the cosine greedy distance of the spectra (one minus the score), with the peaks
+ * matched using pgms.similarity_tolerance.
+ */
+PG_FUNCTION_INFO_V1(spectrum_distance);
+Datum spectrum_distance(PG_FUNCTION_ARGS)
+{
+    float4 score = cosine_greedy_call(fcinfo, similarity_tolerance, 1, 0, false);
 
-    PG_RETURN_FLOAT4(score);
+    PG_RETURN_FLOAT4(1 - score);
 }
@@ -27,162 +27,266 @@
 #include <fmgr.h>
 #include <math.h>
 #include <float.h>
-#include <lib/stringinfo.h>
+#include "similarity/cache.h"
 #include "similarity/cosine.h"
 #include "similarity/lsap.h"
+#include "similarity/pairs.h"
+#include "similarity/scratch.h"
 
 
-#define swap(a,b)   do { typeof(a) t = a; a = b; b = t; } while(0)
+/*
+ * Collects all pairs of peaks within the tolerance together with their scores.
+ */
+static size_t collect_pairs(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance,
+        PairBuffer *pairs)
+{
+    SpectrumCursor peak1;
+    SpectrumCursor lowest;
+    spectrum_cursor_init(&lowest, &spectrum2->spectrum);
 
+    for(spectrum_cursor_init(&peak1, &spectrum1->spectrum); spectrum_cursor_valid(&peak1); spectrum_cursor_next(&peak1))
+    {
+        float weight1 = spectrum_weight(spectrum1, peak1.index);
+        float low_bound = peak1.mz - tolerance;
+        float high_bound = peak1.mz + tolerance;
 
-PG_FUNCTION_INFO_V1(cosine_hungarian);
-Datum cosine_hungarian(PG_FUNCTION_ARGS)
+        spectrum_cursor_skip(&lowest, low_bound);
+
+        for(SpectrumCursor peak2 = lowest; spectrum_cursor_valid(&peak2); spectrum_cursor_next(&peak2))
+        {
+            if(peak2.mz > high_bound)
+                break;
+
+            float s = weight1 * spectrum_weight(spectrum2, peak2.index);
+
+            /* zero scores are still counted as matches */
+            if(s == 0)
+                s = FLT_MIN;
+
+            pair_buffer_add(pairs, peak1.index, peak2.index, s);
+        }
+    }
+
+    return pairs->count;
+}
+
+
+/*
+ * Finds the optimal assignment of the collected pairs and returns the normalized score. Peaks that have only one pair,
+ * whose peak of the other spectrum has no other pair either, are assigned directly by the solver, so they do not enlarge
+ * the assignment problem.
+ */
+float assignment_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2,
+        const PairBuffer *pairs)
 {
-    void *spec1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    void *spec2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    float score = 0;
+    int matches = 0;
 
-    int len1 = (VARSIZE(spec1) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz1 = (float4 *) VARDATA(spec1);
-    float *restrict intensities1 = mz1 + len1;
+    if(pairs->count == 0)
+        return 0;
 
-    int len2 = (VARSIZE(spec2) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz2 = (float4 *) VARDATA(spec2);
-    float *restrict intensities2 = mz2 + len2;
+    solve_sparse_linear_sum_assignment(spectrum1->spectrum.count, spectrum2->spectrum.count, pairs->count,
+            pairs->paired1, pairs->paired2, pairs->scores, &matches, &score);
 
-    const float tolerance = PG_GETARG_FLOAT4(2);
-    const float mz_power = PG_GETARG_FLOAT4(3);
-    const float intensity_power = PG_GETARG_FLOAT4(4);
+    if(score != 0)
+        score /= sqrtf(spectrum1->norm * spectrum2->norm);
 
-    if((size_t) len1 * (size_t) len2 > 100000000)
-        PG_RETURN_NULL();
+    return score;
+}
 
-    int *restrict used1 = palloc(len1 * sizeof(int));
-    int *restrict used2 = palloc(len2 * sizeof(int));
-    StringInfoData buffer1;
-    StringInfoData buffer2;
 
-    memset(used1, 0, len1 * sizeof(int));
-    memset(used2, 0, len2 * sizeof(int));
-    initStringInfo(&buffer1);
-    initStringInfo(&buffer2);
+/*
+ * Computes bounds of the optimal assignment score of the collected pairs without solving the assignment. The upper
+ * bound assigns each peak of one spectrum to its best pair, while the lower bound is the score of the assignment
+ * taking the pairs greedily in the order of m/z values. Pairs have to be ordered by the peaks of the first spectrum.
+ * Returns false if some scores are not finite, the bounds are not valid then.
+ */
+static bool assignment_bounds(const PairBuffer *pairs, int len2, double *upper, double *lower)
+{
+    float *best2 = scratch_alloc(len2 * sizeof(float));
+    bool *used2 = scratch_alloc(len2 * sizeof(bool));
 
-    size_t pairs = 0;
-    int lowest_idx = 0;
+    memset(best2, 0, len2 * sizeof(float));
+    memset(used2, 0, len2 * sizeof(bool));
 
-    for(int peak1 = 0; peak1 < len1; peak1++)
+    double upper1 = 0;
+    double upper2 = 0;
+    double greedy = 0;
+
+    for(size_t i = 0; i < pairs->count;)
     {
-        float low_bound = mz1[peak1] - tolerance;
-        float high_bound = mz1[peak1] + tolerance;
+        int index1 = pairs->paired1[i];
+        float best1 = 0;
+        bool used1 = false;
 
-        for(int peak2 = lowest_idx; peak2 < len2; peak2++)
+        for(; i < pairs->count && pairs->paired1[i] == index1; i++)
         {
-            if(mz2[peak2] > high_bound)
-                break;
+            int index2 = pairs->paired2[i];
+            float score = pairs->scores[i];
 
-            if(mz2[peak2] < low_bound)
-            {
-                lowest_idx = peak2 + 1;
+            if(!isfinite(score))
+                return false;
+
+            /* pairs with negative scores are never assigned */
+            if(score <= 0)
                 continue;
-            }
 
-            used1[peak1]++;
-            used2[peak2]++;
+            if(best1 < score)
+                best1 = score;
+
+            if(best2[index2] < score)
+                best2[index2] = score;
 
-            appendBinaryStringInfoNT(&buffer1, (char *) &peak1, sizeof(int));
-            appendBinaryStringInfoNT(&buffer2, (char *) &peak2, sizeof(int));
-            pairs++;
+            if(!used1 && !used2[index2])
+            {
+                greedy += score;
+                used1 = true;
+                used2[index2] = true;
+            }
         }
+
+        upper1 += best1;
     }
 
-    int *paired1 = (int *) buffer1.data;
-    int *paired2 = (int *) buffer2.data;
+    for(int j = 0; j < len2; j++)
+        upper2 += best2[j];
+
+    *upper = Min(upper1, upper2);
+    *lower = greedy;
+    return true;
+}
+
+
+PG_FUNCTION_INFO_V1(cosine_hungarian);
+Datum cosine_hungarian(PG_FUNCTION_ARGS)
+{
+    const float tolerance = PG_GETARG_FLOAT4(2);
+    const float mz_power = PG_GETARG_FLOAT4(3);
+    const float intensity_power = PG_GETARG_FLOAT4(4);
+
+    PowerKind kind = power_kind(intensity_power, mz_power);
+
+    scratch_begin();
+
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, kind, intensity_power, mz_power, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, kind, intensity_power, mz_power, &buffer2);
 
     float score = 0;
-    int matches = 0;
 
-    if(pairs > 0)
+    if(!spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
     {
-        int *restrict map1 = palloc(len1 * sizeof(int));
-        int *restrict map2 = palloc(len2 * sizeof(int));
+        PairBuffer buffer;
+        pair_buffer_init(&buffer, Max(spectrum1->spectrum.count, spectrum2->spectrum.count));
 
-        memset(map1, -1, len1 * sizeof(int));
-        memset(map2, -1, len2 * sizeof(int));
+        collect_pairs(spectrum1, spectrum2, tolerance, &buffer);
+        score = assignment_score(spectrum1, spectrum2, &buffer);
+    }
 
-        size_t selected1 = 0;
-        size_t selected2 = 0;
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
 
-        for(int i = 0; i < pairs; i++)
-        {
-            if(used1[paired1[i]] != 1 || used2[paired2[i]] != 1)
-            {
-               if(map1[paired1[i]] == -1)
-                   map1[paired1[i]] = selected1++;
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
 
-               if(map2[paired2[i]] == -1)
-                   map2[paired2[i]] = selected2++;
-            }
-        }
+    PG_RETURN_FLOAT4(score);
+}
 
-        if(selected1 > selected2)
-        {
-            swap(selected1, selected2);
-            swap(paired1, paired2);
-            swap(map1, map2);
 
-            swap(intensities1, intensities2);
-            swap(mz1, mz2);
-            swap(len1, len2);
-        }
+/*
+ * Collects the pairs of peaks and tries to decide whether the optimal assignment score reaches the threshold without
+ * solving the assignment. Most of the spectra are rejected by the upper bound computed from the headers before any
+ * peaks are matched, the remaining ones are tested by the upper bound and the greedy lower bound of the collected
+ * pairs. Returns -1 if the score cannot reach the threshold, 1 if it surely exceeds the threshold and 0 if
+ * the assignment has to be solved.
+ */
+static int hungarian_decide(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance,
+        float threshold, PairBuffer *buffer)
+{
+    pair_buffer_init(buffer, Max(spectrum1->spectrum.count, spectrum2->spectrum.count));
 
-        float *restrict cost = palloc_extended(selected1 * selected2 * sizeof(float), MCXT_ALLOC_HUGE);
-        memset(cost, 0, selected1 * selected2 * sizeof(float));
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+        return 0;
 
-        float max = 0;
+    /* negative scores are clamped, so they can still pass negative thresholds */
+    bool bounded = threshold >= 0;
 
-        for(int i = 0; i < pairs; i++)
-        {
-            float s = calc_score(intensities1[paired1[i]], intensities2[paired2[i]], mz1[paired1[i]], mz2[paired2[i]],
-                    intensity_power, mz_power);
+    if(bounded && calc_upper_bound(&spectrum1->spectrum, &spectrum2->spectrum, tolerance, 0) < threshold)
+        return -1;
 
-            if(map1[paired1[i]] != -1 && map2[paired2[i]] != -1)
-            {
-                if(s == 0)
-                    s = FLT_MIN;
+    collect_pairs(spectrum1, spectrum2, tolerance, buffer);
 
-                if(s > max)
-                    max = s;
+    double upper;
+    double lower;
 
-                cost[map1[paired1[i]] * selected2 + map2[paired2[i]]] = s;
-            }
-            else
-            {
-                score += s;
-                matches++;
-            }
-        }
+    if(bounded && assignment_bounds(buffer, spectrum2->spectrum.count, &upper, &lower))
+    {
+        double norm = sqrtf(spectrum1->norm * spectrum2->norm);
 
-        solve_rectangular_linear_sum_assignment(selected1, selected2, cost, max, &matches, &score);
+        if(upper / norm * (1 + BOUND_SLACK) < threshold)
+            return -1;
 
-        if(score != 0)
-        {
-            float norm1 = calc_norm(intensities1, mz1, len1, intensity_power, mz_power);
-            float norm2 = calc_norm(intensities2, mz2, len2, intensity_power, mz_power);
+        /* the greedy assignment cannot be used if the score would be clamped */
+        if(threshold < 1 && isfinite(lower / norm) && lower / norm * (1 - BOUND_SLACK) > threshold)
+            return 1;
+    }
 
-            score /= sqrtf(norm1 * norm2);
-        }
+    return 0;
+}
+
+
+/*
+ * Computes the cosine hungarian score, but gives up if hungarian_decide() proves that the score cannot reach
+ * the threshold. Returns false if the computation has been given up.
+ */
+bool hungarian_bounded_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance,
+        float threshold, float *result)
+{
+    PairBuffer buffer;
+
+    if(hungarian_decide(spectrum1, spectrum2, tolerance, threshold, &buffer) < 0)
+        return false;
+
+    *result = assignment_score(spectrum1, spectrum2, &buffer);
+    return true;
+}
 
-        pfree(cost);
-        pfree(map2);
-        pfree(map1);
-    }
 
-    pfree(paired2);
-    pfree(paired1);
-    pfree(used2);
-    pfree(used1);
+/*
+ * Tests whether the cosine hungarian score for the default powers exceeds the threshold, i.e. it is equivalent to
+ * cosine_hungarian(spectrum1, spectrum2, tolerance) > threshold, but most of the spectra are decided without solving
+ * the assignment by hungarian_decide(). Returns NULL if the score is not a number.
+ */
+PG_FUNCTION_INFO_V1(cosine_hungarian_above);
+Datum cosine_hungarian_above(PG_FUNCTION_ARGS)
+{
+    const float tolerance = PG_GETARG_FLOAT4(2);
+    const float threshold = PG_GETARG_FLOAT4(3);
 
-    PG_FREE_IF_COPY(spec1, 0);
-    PG_FREE_IF_COPY(spec2, 1);
+    scratch_begin();
+
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, POWER_PRODUCT, 1, 0, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, POWER_PRODUCT, 1, 0, &buffer2);
+
+    PairBuffer buffer;
+    int decision = hungarian_decide(spectrum1, spectrum2, tolerance, threshold, &buffer);
+    float score = 0;
+
+    if(decision == 0)
+        score = assignment_score(spectrum1, spectrum2, &buffer);
+
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
+
+    if(decision != 0)
+        PG_RETURN_BOOL(decision > 0);
 
     if(isfinite(score) && score < 0)
         score = 0;
@@ -191,5 +295,8 @@ Datum cosine_hungarian(PG_FUNCTION_ARGS)
     else if(!isfinite(score))
         score = NAN;
 
-    PG_RETURN_FLOAT4(score);
+    if(isnan(score))
+        PG_RETURN_NULL();
+
+    PG_RETURN_BOOL(score > threshold);
 }
@@ -0,0 +1,130 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include "similarity/cache.h"
+#include "similarity/cosine.h"
+
+
+static inline double xlogx(double x)
+{
+    return x == 0 ? 0 : x * log(x);
+}
+
+
+/*
+ * Computes the entropy similarity 1 - (2 * S(AB) - S(A) - S(B)) / ln(4), where AB is the spectrum merged from
+ * the spectra A and B with the intensities normalized to the unit sum. The unmatched peaks do not contribute to
+ * the similarity, so it is accumulated only from the pairs of peaks matched by the greedy merge.
+ */
+static float entropy_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float tolerance)
+{
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+        return 0;
+
+    double score = 0;
+
+    GreedyMerge merge;
+    greedy_merge_init(&merge, &spectrum1->spectrum, &spectrum2->spectrum, tolerance);
+
+    while(greedy_merge_next(&merge))
+    {
+        double intensity1 = spectrum_weight(spectrum1, merge.index1);
+        double intensity2 = spectrum_weight(spectrum2, merge.index2);
+
+        score += xlogx(intensity1 + intensity2) - xlogx(intensity1) - xlogx(intensity2);
+    }
+
+    return score / log(4);
+}
+
+
+static float entropy_similarity_call(FunctionCallInfo fcinfo, PowerKind kind, float4 entropy1, float4 entropy2)
+{
+    float tolerance = PG_GETARG_FLOAT4(2);
+
+    scratch_begin();
+
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, kind, entropy1, 0, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, kind, entropy2, 0, &buffer2);
+
+    float score = entropy_score(spectrum1, spectrum2, tolerance);
+
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
+
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
+
+    return score;
+}
+
+
+PG_FUNCTION_INFO_V1(entropy_similarity);
+Datum entropy_similarity(PG_FUNCTION_ARGS)
+{
+    bool weighted = PG_GETARG_BOOL(3);
+
+    PG_RETURN_FLOAT4(entropy_similarity_call(fcinfo, weighted ? POWER_ENTROPY_WEIGHTED : POWER_ENTROPY, 0, 0));
+}
+
+
+/*
+ * Computes the entropy similarity with the spectral entropies given by the arguments (e.g. stored by
+ * spectrum_entropy() in a column), so that they are not recomputed for every pair of spectra. The score is equal to
+ * the score of entropy_similarity() if the entropies are the values returned by spectrum_entropy().
+ */
+PG_FUNCTION_INFO_V1(entropy_similarity_entropies);
+Datum entropy_similarity_entropies(PG_FUNCTION_ARGS)
+{
+    bool weighted = PG_GETARG_BOOL(3);
+    float4 entropy1 = PG_GETARG_FLOAT4(4);
+    float4 entropy2 = PG_GETARG_FLOAT4(5);
+
+    if(!weighted)
+        PG_RETURN_FLOAT4(entropy_similarity_call(fcinfo, POWER_ENTROPY, 0, 0));
+
+    PG_RETURN_FLOAT4(entropy_similarity_call(fcinfo, POWER_ENTROPY_GIVEN, entropy1, entropy2));
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_entropy);
+Datum spectrum_entropy(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    float4 entropy = calc_entropy(&spectrum);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_FLOAT4(entropy);
+}
@@ -25,49 +25,91 @@
 #include <fmgr.h>
 #include <float.h>
 #include <math.h>
+#include "pgms.h"
+#include "spectrum.h"
 
 
-PG_FUNCTION_INFO_V1(intersect_mz);
-Datum intersect_mz(PG_FUNCTION_ARGS)
+static size_t intersect_count(const Spectrum *spectrum1, const Spectrum *spectrum2, float tolerance)
 {
-    void *spec1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    size_t len1 = (VARSIZE(spec1) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz1 = (float4 *) VARDATA(spec1);
-
-    void *spec2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
-    size_t len2 = (VARSIZE(spec2) - VARHDRSZ) / sizeof(float4) / 2;
-    float *restrict mz2 = (float4 *) VARDATA(spec2);
-
-    const float tolerance = PG_GETARG_FLOAT4(2);
+    if(spectrum_disjoint(spectrum1, spectrum2, tolerance))
+        return 0;
 
     size_t count_intersect = 0;
 
-    Index peak1 = 0;
-    Index peak2 = 0;
+    SpectrumCursor peak1;
+    SpectrumCursor peak2;
+    spectrum_cursor_init(&peak1, spectrum1);
+    spectrum_cursor_init(&peak2, spectrum2);
 
-    while(peak1 < len1 && peak2 < len2)
+    while(spectrum_cursor_valid(&peak1) && spectrum_cursor_valid(&peak2))
     {
-        float low_bound = mz1[peak1] - tolerance;
-        float high_bound = mz1[peak1] + tolerance;
+        float low_bound = peak1.mz - tolerance;
+        float high_bound = peak1.mz + tolerance;
+
+        /* peaks below both bounds are skipped by the branches below also for negative tolerances */
+        spectrum_cursor_skip(&peak2, Min(low_bound, high_bound));
 
-        if(low_bound < mz2[peak2])
+        if(!spectrum_cursor_valid(&peak2))
+            break;
+
+        if(peak2.mz < low_bound)
         {
-            peak1++;
+            spectrum_cursor_next(&peak2);
         }
-        else if(high_bound > mz2[peak2])
+        else if(peak2.mz > high_bound)
         {
-            peak2++;
+            spectrum_cursor_next(&peak1);
         }
         else
         {
-            peak1++;
-            peak2++;
+            spectrum_cursor_next(&peak1);
+            spectrum_cursor_next(&peak2);
             count_intersect++;
         }
     }
 
+    return count_intersect;
+}
+
+
+PG_FUNCTION_INFO_V1(intersect_mz);
+Datum intersect_mz(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum1;
+    Spectrum spectrum2;
+    void *spec1 = spectrum_detoast_mz(PG_GETARG_DATUM(0), &spectrum1);
+    void *spec2 = spectrum_detoast_mz(PG_GETARG_DATUM(1), &spectrum2);
+
+    const float tolerance = PG_GETARG_FLOAT4(2);
+
+    size_t count_intersect = intersect_count(&spectrum1, &spectrum2, tolerance);
+
+    size_t len1 = spectrum1.count;
+    size_t len2 = spectrum2.count;
+
     PG_FREE_IF_COPY(spec1, 0);
     PG_FREE_IF_COPY(spec2, 1);
 
     PG_RETURN_FLOAT4(count_intersect == 0 ? 0 : count_intersect / (float) (len1 + len2 - count_intersect));
 }
+
+
+/*
+ * Implements the && operator: spectra have to share at least pgms.min_shared_peaks peaks matched using
+ * pgms.similarity_tolerance.
+ */
+PG_FUNCTION_INFO_V1(spectrum_overlaps);
+Datum spectrum_overlaps(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum1;
+    Spectrum spectrum2;
+    void *spec1 = spectrum_detoast_mz(PG_GETARG_DATUM(0), &spectrum1);
+    void *spec2 = spectrum_detoast_mz(PG_GETARG_DATUM(1), &spectrum2);
+
+    size_t count_intersect = intersect_count(&spectrum1, &spectrum2, similarity_tolerance);
+
+    PG_FREE_IF_COPY(spec1, 0);
+    PG_FREE_IF_COPY(spec2, 1);
+
+    PG_RETURN_BOOL(count_intersect >= (size_t) min_shared_peaks);
+}
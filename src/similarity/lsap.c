@@ -37,6 +37,11 @@ pseudocode described in pages 1685-1686 of:
     52(4):1679-1696, August 2016
     doi: 10.1109/TAES.2016.140952
 
+The dense cost matrix of the original implementation is replaced by
+a sparse graph of candidate pairs, which is split into connected
+components solved independently. The shortest paths are searched by
+Dijkstra's algorithm with a binary heap over the edges of the graph.
+
 Author: PM Larsen
         Jakub Galgonek
 */
@@ -44,137 +49,241 @@ Author: PM Larsen
 #include <postgres.h>
 #include <math.h>
 #include <stdbool.h>
+#include <miscadmin.h>
 #include "similarity/lsap.h"
+#include "similarity/scratch.h"
 
 
-static inline int augmenting_path(int nr, int nc, const float *restrict cost, float offset, const float *restrict u,
-        const float *restrict v, int *restrict path, int *restrict row4col, float *restrict shortest_paths, int i,
-        bool *restrict sr, bool *restrict sc, int *restrict remaining, float *restrict pmin)
+typedef struct
 {
-    float min = 0;
-    int num_remaining = nc;
+    float key;
+    int column;
+}
+HeapItem;
 
-    // Filling this up in reverse order ensures that the solution of a
-    // constant cost matrix is the identity matrix (c.f. #11602).
-    for(int it = 0; it < nc; it++)
-        remaining[it] = nc - it - 1;
 
-    for(int i = 0; i < nr; i++)
-        sr[i] = false;
+/*
+ * Columns with the same distance are ordered so that free columns go first, which gives us a new sink node sooner.
+ */
+static inline bool heap_less(const HeapItem *restrict a, const HeapItem *restrict b, const int *restrict row4col)
+{
+    return a->key < b->key || (a->key == b->key && row4col[a->column] == -1 && row4col[b->column] != -1);
+}
+
+
+static inline void heap_push(HeapItem *restrict heap, size_t *restrict size, float key, int column,
+        const int *restrict row4col)
+{
+    size_t i = (*size)++;
+    HeapItem item = { key, column };
+
+    while(i > 0 && heap_less(&item, &heap[(i - 1) / 2], row4col))
+    {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+
+    heap[i] = item;
+}
+
+
+static inline HeapItem heap_pop(HeapItem *restrict heap, size_t *restrict size, const int *restrict row4col)
+{
+    HeapItem top = heap[0];
+    HeapItem last = heap[--(*size)];
+    size_t i = 0;
+
+    while(true)
+    {
+        size_t child = 2 * i + 1;
+
+        if(child >= *size)
+            break;
+
+        if(child + 1 < *size && heap_less(&heap[child + 1], &heap[child], row4col))
+            child++;
+
+        if(!heap_less(&heap[child], &last, row4col))
+            break;
 
-    for(int i = 0; i < nc; i++)
-        sc[i] = false;
+        heap[i] = heap[child];
+        i = child;
+    }
 
-    for(int i = 0; i < nc; i++)
-        shortest_paths[i] = INFINITY;
+    if(*size > 0)
+        heap[i] = last;
 
+    return top;
+}
+
+
+typedef struct
+{
+    int nr;
+    int nc;
+    const size_t *start;    /* edges of the i-th row are start[i] ... start[i + 1] - 1 */
+    const int *column;
+    const float *cost;
+    float offset;           /* cost of the dummy column of each row, i.e. of leaving the row unassigned */
+
+    float *u;
+    float *v;
+    float *shortest_paths;
+    int *path;
+    int *col4row;
+    int *row4col;
+    bool *sc;
+    int *visited_rows;
+    int *visited_columns;
+    HeapItem *heap;
+}
+SparseProblem;
+
+
+/*
+ * Each row i has a private dummy column nc + i, so a complete assignment of rows always exists.
+ */
+static inline int augmenting_path(SparseProblem *problem, int i, float *pmin, int *prows, int *pcolumns)
+{
+    const int nc = problem->nc;
+    const size_t *restrict start = problem->start;
+    const int *restrict column = problem->column;
+    const float *restrict cost = problem->cost;
+    const float *restrict u = problem->u;
+    const float *restrict v = problem->v;
+    float *restrict shortest_paths = problem->shortest_paths;
+    int *restrict path = problem->path;
+    int *restrict row4col = problem->row4col;
+    bool *restrict sc = problem->sc;
+    int *restrict visited_rows = problem->visited_rows;
+    int *restrict visited_columns = problem->visited_columns;
+    HeapItem *restrict heap = problem->heap;
+
+    float min = 0;
+    int nrows = 0;
+    int ncolumns = 0;
+    size_t size = 0;
 
     // find shortest augmenting path
     int sink = -1;
     while(sink == -1)
     {
-        int index = -1;
-        float lowest = INFINITY;
-        sr[i] = true;
+        visited_rows[nrows++] = i;
 
-        for(int it = 0; it < num_remaining; it++)
+        for(size_t e = start[i]; e <= start[i + 1]; e++)
         {
-            int j = remaining[it];
+            int j = e < start[i + 1] ? column[e] : nc + i;
+            float c = e < start[i + 1] ? cost[e] : problem->offset;
+
+            if(sc[j])
+                continue;
 
-            // true cost value is offset - cost[i * nc + j]
-            float r = min + offset - cost[i * (size_t) nc + j] - u[i] - v[j];
+            float r = min + c - u[i] - v[j];
 
             if(r < shortest_paths[j])
             {
+                if(shortest_paths[j] == INFINITY)
+                    visited_columns[ncolumns++] = j;
+
                 path[j] = i;
                 shortest_paths[j] = r;
+                heap_push(heap, &size, r, j, row4col);
             }
+        }
+
+        // the heap can contain outdated distances of columns
+        int j = -1;
+
+        while(size > 0)
+        {
+            HeapItem item = heap_pop(heap, &size, row4col);
 
-            // When multiple nodes have the minimum cost, we select one which
-            // gives us a new sink node. This is particularly important for
-            // integer cost matrices with small co-efficients.
-            if(shortest_paths[j] < lowest || (shortest_paths[j] == lowest && row4col[j] == -1))
+            if(!sc[item.column] && item.key == shortest_paths[item.column])
             {
-                lowest = shortest_paths[j];
-                index = it;
+                j = item.column;
+                break;
             }
         }
 
-        min = lowest;
-        int j = remaining[index];
+        if(j == -1)
+            break;
 
-        if(min == INFINITY)
-            return -1; // infeasible cost matrix
+        min = shortest_paths[j];
+        sc[j] = true;
 
         if(row4col[j] == -1)
             sink = j;
         else
             i = row4col[j];
-
-        sc[j] = true;
-        remaining[index] = remaining[--num_remaining];
     }
 
     *pmin = min;
+    *prows = nrows;
+    *pcolumns = ncolumns;
     return sink;
 }
 
 
-void solve_rectangular_linear_sum_assignment(int nr, int nc, const float *restrict cost, float offset,
-        int *restrict matched, float *restrict score)
+static bool solve_sparse_problem(SparseProblem *problem)
 {
-    if(offset == INFINITY)
+    const int nr = problem->nr;
+    const int nc = problem->nc;
+    float *restrict u = problem->u;
+    float *restrict v = problem->v;
+    float *restrict shortest_paths = problem->shortest_paths;
+    int *restrict path = problem->path;
+    int *restrict col4row = problem->col4row;
+    int *restrict row4col = problem->row4col;
+    bool *restrict sc = problem->sc;
+
+    for(int i = 0; i < nr; i++)
     {
-        *score = NAN;
-        *matched = -1;
-        return;
+        u[i] = 0;
+        col4row[i] = -1;
     }
 
-    // handle trivial inputs
-    if(nr == 0 || nc == 0)
-        return;
-
-    // initialize variables
-    float *restrict u = palloc(nr * sizeof(float));
-    float *restrict v = palloc(nc * sizeof(float));
-    float *restrict shortest_paths = palloc(nc * sizeof(float));
-    int *restrict path = palloc(nc * sizeof(int));
-    int *restrict col4row = palloc(nr * sizeof(int));
-    int *restrict row4col = palloc(nc * sizeof(int));
-    bool *restrict sr = palloc(nr * sizeof(bool));
-    bool *restrict sc = palloc(nc * sizeof(bool));
-    int *restrict remaining = palloc(nc * sizeof(int));
-    bool infeasible = false;
-
-    memset(u, 0, nr * sizeof(float));
-    memset(v, 0, nc * sizeof(float));
-    memset(path, -1, nc * sizeof(int));
-    memset(col4row, -1, nr * sizeof(int));
-    memset(row4col, -1, nc * sizeof(int));
+    for(int j = 0; j < nc + nr; j++)
+    {
+        v[j] = 0;
+        shortest_paths[j] = INFINITY;
+        path[j] = -1;
+        row4col[j] = -1;
+        sc[j] = false;
+    }
 
     // iteratively build the solution
     for(int row = 0; row < nr; row++)
     {
+        CHECK_FOR_INTERRUPTS();
+
         float min;
-        int sink = augmenting_path(nr, nc, cost, offset, u, v, path, row4col, shortest_paths, row, sr, sc, remaining, &min);
+        int nrows;
+        int ncolumns;
+        int sink = augmenting_path(problem, row, &min, &nrows, &ncolumns);
 
         if(sink < 0)
-        {
-            infeasible = true;
-            break;
-        }
+            return false;
 
         // update dual variables
         u[row] += min;
 
-        for(int i = 0; i < nr; i++)
-            if(sr[i] && i != row)
-                u[i] += min - shortest_paths[col4row[i]];
+        for(int k = 1; k < nrows; k++)
+        {
+            int i = problem->visited_rows[k];
+            u[i] += min - shortest_paths[col4row[i]];
+        }
+
+        for(int k = 0; k < ncolumns; k++)
+        {
+            int j = problem->visited_columns[k];
 
-        for(int j = 0; j < nc; j++)
             if(sc[j])
                 v[j] -= min - shortest_paths[j];
 
+            shortest_paths[j] = INFINITY;
+            sc[j] = false;
+        }
+
         // augment previous solution
         while(true)
         {
@@ -190,20 +299,231 @@ void solve_rectangular_linear_sum_assignment(int nr, int nc, const float *restri
         }
     }
 
-    if(!infeasible)
+    return true;
+}
+
+
+static inline int find_root(int *restrict parent, int node)
+{
+    while(parent[node] != node)
+    {
+        parent[node] = parent[parent[node]];
+        node = parent[node];
+    }
+
+    return node;
+}
+
+
+void solve_sparse_linear_sum_assignment(int nr, int nc, size_t npairs, const int *restrict rows,
+        const int *restrict columns, const float *restrict weights, int *restrict matched, float *restrict score)
+{
+    for(size_t e = 0; e < npairs; e++)
+    {
+        if(!isfinite(weights[e]))
+        {
+            *score = NAN;
+            *matched = -1;
+            return;
+        }
+    }
+
+    // handle trivial inputs
+    if(npairs == 0)
+        return;
+
+    // split the graph into connected components, rows are nodes 0 ... nr - 1 and columns are nodes nr ... nr + nc - 1
+    int nodes = nr + nc;
+    int *restrict parent = scratch_alloc(nodes * sizeof(int));
+
+    for(int k = 0; k < nodes; k++)
+        parent[k] = k;
+
+    for(size_t e = 0; e < npairs; e++)
+    {
+        int a = find_root(parent, rows[e]);
+        int b = find_root(parent, nr + columns[e]);
+
+        if(a != b)
+            parent[Max(a, b)] = Min(a, b);
+    }
+
+    // sort edges by their components
+    size_t *restrict offsets = scratch_alloc((nodes + 1) * sizeof(size_t));
+    size_t *restrict order = scratch_alloc(npairs * sizeof(size_t));
+    memset(offsets, 0, (nodes + 1) * sizeof(size_t));
+
+    for(size_t e = 0; e < npairs; e++)
+        offsets[find_root(parent, rows[e]) + 1]++;
+
+    for(int k = 0; k < nodes; k++)
+        offsets[k + 1] += offsets[k];
+
+    for(size_t e = 0; e < npairs; e++)
+        order[offsets[find_root(parent, rows[e])]++] = e;
+
+    for(int k = nodes; k > 0; k--)
+        offsets[k] = offsets[k - 1];
+
+    offsets[0] = 0;
+
+    // working space shared by all components
+    int *restrict local = scratch_alloc(nodes * sizeof(int));
+    size_t *restrict start = scratch_alloc((nodes + 1) * sizeof(size_t));
+    int *restrict column = scratch_alloc(npairs * sizeof(int));
+    float *restrict cost = scratch_alloc(npairs * sizeof(float));
+    float *restrict weight = scratch_alloc(npairs * sizeof(float));
+
+    SparseProblem problem;
+    problem.start = start;
+    problem.column = column;
+    problem.cost = cost;
+    problem.u = scratch_alloc(nodes * sizeof(float));
+    problem.v = scratch_alloc(2 * nodes * sizeof(float));
+    problem.shortest_paths = scratch_alloc(2 * nodes * sizeof(float));
+    problem.path = scratch_alloc(2 * nodes * sizeof(int));
+    problem.col4row = scratch_alloc(nodes * sizeof(int));
+    problem.row4col = scratch_alloc(2 * nodes * sizeof(int));
+    problem.sc = scratch_alloc(2 * nodes * sizeof(bool));
+    problem.visited_rows = scratch_alloc(nodes * sizeof(int));
+    problem.visited_columns = scratch_alloc(2 * nodes * sizeof(int));
+    problem.heap = scratch_alloc((npairs + nodes) * sizeof(HeapItem));
+
+    memset(local, -1, nodes * sizeof(int));
+
+    int cnt = 0;
+    float sum = 0;
+    bool infeasible = false;
+
+    for(int k = 0; k < nodes && !infeasible; k++)
     {
-        int cnt = 0;
-        float sum = 0;
+        size_t first = offsets[k];
+        size_t count = offsets[k + 1] - offsets[k];
 
-        for(int i = 0; i < nr; i++)
+        if(count == 0)
+            continue;
+
+        if(count == 1)
         {
-            if(cost[i * (size_t) nc + col4row[i]] > 0)
+            if(weights[order[first]] > 0)
             {
-                sum += cost[i * (size_t) nc + col4row[i]];
+                sum += weights[order[first]];
                 cnt++;
             }
+
+            continue;
         }
 
+        // number the rows and the columns of the component
+        int crows = 0;
+        int ccolumns = 0;
+
+        for(size_t e = first; e < first + count; e++)
+        {
+            if(local[rows[order[e]]] == -1)
+                local[rows[order[e]]] = crows++;
+
+            if(local[nr + columns[order[e]]] == -1)
+                local[nr + columns[order[e]]] = ccolumns++;
+        }
+
+        // a single peak competing for several peaks gets the best of them, no matrix is needed
+        if(crows == 1 || ccolumns == 1)
+        {
+            float best = 0;
+
+            for(size_t e = first; e < first + count; e++)
+            {
+                if(weights[order[e]] > best)
+                    best = weights[order[e]];
+
+                local[rows[order[e]]] = -1;
+                local[nr + columns[order[e]]] = -1;
+            }
+
+            if(best > 0)
+            {
+                sum += best;
+                cnt++;
+            }
+
+            continue;
+        }
+
+        // the smaller side is assigned to the larger one
+        bool transpose = crows > ccolumns;
+        problem.nr = transpose ? ccolumns : crows;
+        problem.nc = transpose ? crows : ccolumns;
+        problem.offset = 0;
+
+        memset(start, 0, (problem.nr + 1) * sizeof(size_t));
+
+        for(size_t e = first; e < first + count; e++)
+        {
+            int r = local[rows[order[e]]];
+            int c = local[nr + columns[order[e]]];
+            start[(transpose ? c : r) + 1]++;
+
+            if(weights[order[e]] > problem.offset)
+                problem.offset = weights[order[e]];
+        }
+
+        for(int i = 0; i < problem.nr; i++)
+            start[i + 1] += start[i];
+
+        for(size_t e = first; e < first + count; e++)
+        {
+            int r = local[rows[order[e]]];
+            int c = local[nr + columns[order[e]]];
+            size_t position = start[transpose ? c : r]++;
+
+            column[position] = transpose ? r : c;
+            weight[position] = weights[order[e]];
+
+            // true cost value is offset - weight
+            cost[position] = problem.offset - weights[order[e]];
+        }
+
+        for(int i = problem.nr; i > 0; i--)
+            start[i] = start[i - 1];
+
+        start[0] = 0;
+
+        if(!solve_sparse_problem(&problem))
+        {
+            infeasible = true;
+            break;
+        }
+
+        for(int i = 0; i < problem.nr; i++)
+        {
+            if(problem.col4row[i] >= problem.nc)
+                continue;
+
+            for(size_t e = start[i]; e < start[i + 1]; e++)
+            {
+                if(column[e] == problem.col4row[i])
+                {
+                    if(weight[e] > 0)
+                    {
+                        sum += weight[e];
+                        cnt++;
+                    }
+
+                    break;
+                }
+            }
+        }
+
+        for(size_t e = first; e < first + count; e++)
+        {
+            local[rows[order[e]]] = -1;
+            local[nr + columns[order[e]]] = -1;
+        }
+    }
+
+    if(!infeasible)
+    {
         *score += sum;
         *matched += cnt;
     }
@@ -212,14 +532,4 @@ void solve_rectangular_linear_sum_assignment(int nr, int nc, const float *restri
         *score = NAN;
         *matched = -1;
     }
-
-    pfree(remaining);
-    pfree(sc);
-    pfree(sr);
-    pfree(row4col);
-    pfree(col4row);
-    pfree(path);
-    pfree(shortest_paths);
-    pfree(v);
-    pfree(u);
 }
@@ -31,7 +31,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef LSAP_H
 #define LSAP_H
 
-void solve_rectangular_linear_sum_assignment(int nr, int nc, const float *restrict cost, float offset,
-        int *restrict matched, float *restrict score);
+/*
+ * Finds the assignment of rows to columns maximizing the sum of weights, where only the given pairs of rows and columns
+ * can be assigned and rows or columns can remain unassigned. The weight and the number of assigned pairs with positive
+ * weights are added to score and matched. The working memory is taken by scratch_alloc().
+ */
+void solve_sparse_linear_sum_assignment(int nr, int nc, size_t npairs, const int *restrict rows,
+        const int *restrict columns, const float *restrict weights, int *restrict matched, float *restrict score);
 
 #endif /* LSAP_H */
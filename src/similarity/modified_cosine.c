@@ -26,65 +26,400 @@
 #endif
 #include <fmgr.h>
 #include <math.h>
+#include <float.h>
+#include "similarity/cache.h"
 #include "similarity/cosine.h"
+#include "similarity/pairs.h"
+
+
+#define RADIX_BITS      8
+#define RADIX_MASK      ((1 << RADIX_BITS) - 1)
+
+
+typedef struct
+{
+    uint32 key;
+    int position;
+}
+RankedPair;
+
+
+/*
+ * Moves the cursor to the first peak whose m/z value increased by the shift falls into the window. Returns false if
+ * there is no such peak.
+ */
+static inline bool window_peak(SpectrumCursor *cursor, float shift, float low_bound, float high_bound)
+{
+    for(; spectrum_cursor_valid(cursor); spectrum_cursor_next(cursor))
+    {
+        float mz = cursor->mz + shift;
+
+        if(mz > high_bound)
+            return false;
+
+        if(!(mz < low_bound))
+            return true;
+    }
+
+    return false;
+}
+
+
+/*
+ * Returns true if no peak of the query spectrum can be matched to a peak of the reference spectrum neither directly
+ * nor after the shift is added to it.
+ */
+static bool modified_disjoint(const Spectrum *reference, const Spectrum *query, float shift, float tolerance)
+{
+    if(!spectrum_disjoint(reference, query, tolerance))
+        return false;
+
+    return spectrum_mz_max(query) + shift < spectrum_mz_min(reference) - tolerance ||
+            spectrum_mz_min(query) + shift > spectrum_mz_max(reference) + tolerance;
+}
+
+
+/*
+ * Collects the pairs of peaks matched directly or after the shift is added to the m/z value of the query peak. Both
+ * windows of a reference peak are enumerated by their own cursors that only move forward, so the pairs are found
+ * in O(n + m + pairs) time. The pairs of each reference peak are ordered by the query peaks, and the peaks lying in
+ * both windows are paired only once.
+ */
+size_t collect_modified_pairs(const WeightedSpectrum *reference, const WeightedSpectrum *query, float shift,
+        float tolerance, PairBuffer *pairs)
+{
+    SpectrumCursor reference_peak;
+    SpectrumCursor lowest_direct;
+    SpectrumCursor lowest_shifted;
+    spectrum_cursor_init(&lowest_direct, &query->spectrum);
+    spectrum_cursor_init(&lowest_shifted, &query->spectrum);
+
+    for(spectrum_cursor_init(&reference_peak, &reference->spectrum); spectrum_cursor_valid(&reference_peak); spectrum_cursor_next(&reference_peak))
+    {
+        float weight = spectrum_weight(reference, reference_peak.index);
+        float low_bound = reference_peak.mz - tolerance;
+        float high_bound = reference_peak.mz + tolerance;
+
+        /* peaks below both bounds are skipped by window_peak() also for negative tolerances */
+        spectrum_cursor_skip(&lowest_direct, Min(low_bound, high_bound));
+
+        while(spectrum_cursor_valid(&lowest_shifted) && lowest_shifted.mz + shift < Min(low_bound, high_bound))
+            spectrum_cursor_next(&lowest_shifted);
+
+        SpectrumCursor direct = lowest_direct;
+        SpectrumCursor shifted = lowest_shifted;
+        bool has_direct = window_peak(&direct, 0, low_bound, high_bound);
+        bool has_shifted = window_peak(&shifted, shift, low_bound, high_bound);
+
+        while(has_direct || has_shifted)
+        {
+            int index = has_direct && (!has_shifted || direct.index <= shifted.index) ? direct.index : shifted.index;
+
+            pair_buffer_add(pairs, reference_peak.index, index, weight * spectrum_weight(query, index));
+
+            if(has_direct && direct.index == index)
+            {
+                spectrum_cursor_next(&direct);
+                has_direct = window_peak(&direct, 0, low_bound, high_bound);
+            }
+
+            if(has_shifted && shifted.index == index)
+            {
+                spectrum_cursor_next(&shifted);
+                has_shifted = window_peak(&shifted, shift, low_bound, high_bound);
+            }
+        }
+    }
+
+    return pairs->count;
+}
+
+
+/*
+ * Maps the score to a key whose ascending order is the order of decreasing scores. Not a number is ranked first,
+ * so that it propagates to the score, and both zeros are ranked equally.
+ */
+static inline uint32 ranked_key(float score)
+{
+    if(isnan(score))
+        return 0;
+
+    if(score == 0)
+        score = 0;
+
+    uint32 bits;
+    memcpy(&bits, &score, sizeof(uint32));
+
+    /* flipping the bits of negative values and the sign bit of positive ones gives the ascending order of scores */
+    return bits & 0x80000000 ? bits : ~bits & 0x7FFFFFFF;
+}
+
+
+/*
+ * Sorts the pairs by their keys using the least significant digit radix sort, which is stable, so the ties keep
+ * their order in the array. Passes over bytes shared by all keys are skipped, these are usually the high bytes.
+ */
+static RankedPair *ranked_pair_sort(RankedPair *ranked, RankedPair *buffer, size_t count)
+{
+    uint32 differ = 0;
+
+    for(size_t i = 1; i < count; i++)
+        differ |= ranked[i].key ^ ranked[0].key;
+
+    for(int shift = 0; shift < 32; shift += RADIX_BITS)
+    {
+        if(((differ >> shift) & RADIX_MASK) == 0)
+            continue;
+
+        size_t offsets[RADIX_MASK + 1] = { 0 };
+
+        for(size_t i = 0; i < count; i++)
+            offsets[(ranked[i].key >> shift) & RADIX_MASK]++;
+
+        size_t position = 0;
+
+        for(int d = 0; d <= RADIX_MASK; d++)
+        {
+            size_t size = offsets[d];
+            offsets[d] = position;
+            position += size;
+        }
+
+        for(size_t i = 0; i < count; i++)
+            buffer[offsets[(ranked[i].key >> shift) & RADIX_MASK]++] = ranked[i];
+
+        RankedPair *swap = ranked;
+        ranked = buffer;
+        buffer = swap;
+    }
+
+    return ranked;
+}
+
+
+/*
+ * The pairs are assigned in the order of decreasing scores as by matchms, each peak is assigned at most once. The ties
+ * are assigned in the reverse order of the pairs, because matchms reverses the stable ascending sort of the scores.
+ * The pairs are ordered by a radix sort of the score bits, which takes a constant number of linear passes.
+ */
+float greedy_assignment(const PairBuffer *pairs, int count1, int count2)
+{
+    RankedPair *ranked = scratch_alloc(pairs->count * sizeof(RankedPair));
+    RankedPair *buffer = scratch_alloc(pairs->count * sizeof(RankedPair));
+    bool *used1 = scratch_alloc(count1 * sizeof(bool));
+    bool *used2 = scratch_alloc(count2 * sizeof(bool));
+
+    memset(used1, 0, count1 * sizeof(bool));
+    memset(used2, 0, count2 * sizeof(bool));
+
+    for(size_t i = 0; i < pairs->count; i++)
+    {
+        int position = pairs->count - 1 - i;
+        ranked[i] = (RankedPair) { ranked_key(pairs->scores[position]), position };
+    }
+
+    ranked = ranked_pair_sort(ranked, buffer, pairs->count);
+
+    float score = 0;
+
+    for(size_t i = 0; i < pairs->count; i++)
+    {
+        int position = ranked[i].position;
+        int index1 = pairs->paired1[position];
+        int index2 = pairs->paired2[position];
+
+        if(used1[index1] || used2[index2])
+            continue;
+
+        used1[index1] = true;
+        used2[index2] = true;
+        score += pairs->scores[position];
+    }
+
+    return score;
+}
+
+
+/*
+ * Collects the pairs of peaks matched after the shift is added to the m/z value of the query peak in the order
+ * of matchms, i.e. ordered by the reference peaks and then by the query peaks.
+ */
+static void collect_window_pairs(const WeightedSpectrum *reference, const WeightedSpectrum *query, float shift,
+        float tolerance, PairBuffer *pairs)
+{
+    SpectrumCursor reference_peak;
+    SpectrumCursor lowest;
+    spectrum_cursor_init(&lowest, &query->spectrum);
+
+    for(spectrum_cursor_init(&reference_peak, &reference->spectrum); spectrum_cursor_valid(&reference_peak); spectrum_cursor_next(&reference_peak))
+    {
+        float weight = spectrum_weight(reference, reference_peak.index);
+        float low_bound = reference_peak.mz - tolerance;
+        float high_bound = reference_peak.mz + tolerance;
+
+        while(spectrum_cursor_valid(&lowest) && lowest.mz + shift < Min(low_bound, high_bound))
+            spectrum_cursor_next(&lowest);
+
+        for(SpectrumCursor peak = lowest; window_peak(&peak, shift, low_bound, high_bound); spectrum_cursor_next(&peak))
+            pair_buffer_add(pairs, reference_peak.index, peak.index, weight * spectrum_weight(query, peak.index));
+    }
+}
+
+
+/*
+ * Computes the modified cosine score from the pairs matched directly or after the shift, the pairs are assigned
+ * greedily by their scores. As by matchms, the pairs matched directly are followed by the pairs matched after
+ * the shift, so that the ties are assigned in the same order, and a pair matched both ways is collected twice. Without
+ * the shift, the second copies of the pairs would not change the assignment, so they are not collected.
+ */
+float modified_score(const WeightedSpectrum *reference, const WeightedSpectrum *query, float shift,
+        float tolerance)
+{
+    if(modified_disjoint(&reference->spectrum, &query->spectrum, shift, tolerance))
+        return 0;
+
+    PairBuffer pairs;
+    pair_buffer_init(&pairs, Max(reference->spectrum.count, query->spectrum.count));
+
+    collect_window_pairs(reference, query, 0, tolerance, &pairs);
+
+    if(shift != 0)
+        collect_window_pairs(reference, query, shift, tolerance, &pairs);
+
+    if(pairs.count == 0)
+        return 0;
+
+    float score = greedy_assignment(&pairs, reference->spectrum.count, query->spectrum.count);
+
+    if(score != 0)
+        score /= sqrtf(reference->norm * query->norm);
+
+    return score;
+}
 
 
 PG_FUNCTION_INFO_V1(modified_cosine);
 Datum modified_cosine(PG_FUNCTION_ARGS)
 {
-    bytea *reference = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    bytea *query = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+    float4 shift = PG_GETARG_FLOAT4(2);
+    float4 tolerance = PG_GETARG_FLOAT4(3);
+    float4 mz_power = PG_GETARG_FLOAT4(4);
+    float4 intensity_power = PG_GETARG_FLOAT4(5);
+
+    PowerKind kind = power_kind(intensity_power, mz_power);
+
+    scratch_begin();
 
-    size_t reference_len = (VARSIZE(reference) - VARHDRSZ) / sizeof(float4) / 2;
-    float4 *restrict reference_mzs = (float4 *) VARDATA(reference);
-    float4 *restrict reference_peaks = reference_mzs + reference_len;
+    WeightedSpectrum reference_buffer;
+    WeightedSpectrum query_buffer;
+    const WeightedSpectrum *reference = similarity_argument(fcinfo, 0, kind, intensity_power, mz_power,
+            &reference_buffer);
+    const WeightedSpectrum *query = similarity_argument(fcinfo, 1, kind, intensity_power, mz_power, &query_buffer);
 
-    size_t query_len = (VARSIZE(query) - VARHDRSZ) / sizeof(float4) / 2;
-    float4 *restrict query_mzs = (float4 *) VARDATA(query);
-    float4 *restrict query_peaks = query_mzs + query_len;
+    float4 score = modified_score(reference, query, shift, tolerance);
 
+    similarity_argument_free(fcinfo, 0, reference, &reference_buffer);
+    similarity_argument_free(fcinfo, 1, query, &query_buffer);
+
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
+
+    PG_RETURN_FLOAT4(score);
+}
+
+
+/*
+ * Computes the modified cosine score from the optimal assignment of the pairs matched directly or after the shift,
+ * the same pairs as by modified_cosine() are passed to the solver of cosine_hungarian.
+ */
+PG_FUNCTION_INFO_V1(modified_cosine_hungarian);
+Datum modified_cosine_hungarian(PG_FUNCTION_ARGS)
+{
     float4 shift = PG_GETARG_FLOAT4(2);
     float4 tolerance = PG_GETARG_FLOAT4(3);
     float4 mz_power = PG_GETARG_FLOAT4(4);
     float4 intensity_power = PG_GETARG_FLOAT4(5);
 
-    size_t matches = 0;
-    Index lowest_idx = 0;
+    PowerKind kind = power_kind(intensity_power, mz_power);
+
+    scratch_begin();
+
+    WeightedSpectrum reference_buffer;
+    WeightedSpectrum query_buffer;
+    const WeightedSpectrum *reference = similarity_argument(fcinfo, 0, kind, intensity_power, mz_power,
+            &reference_buffer);
+    const WeightedSpectrum *query = similarity_argument(fcinfo, 1, kind, intensity_power, mz_power, &query_buffer);
+
     float4 score = 0;
 
-    for(Index reference_index = 0; reference_index < reference_len; reference_index++)
+    if(!modified_disjoint(&reference->spectrum, &query->spectrum, shift, tolerance))
     {
-        float4 low_bound = reference_mzs[reference_index] - tolerance;
-        float4 high_bound = reference_mzs[reference_index] + tolerance;
+        PairBuffer pairs;
+        pair_buffer_init(&pairs, Max(reference->spectrum.count, query->spectrum.count));
+        collect_modified_pairs(reference, query, shift, tolerance, &pairs);
 
-        for(Index query_index = lowest_idx; query_index < query_len; query_index++)
-        {
-            if(Max(query_mzs[query_index], query_mzs[query_index] + shift) > high_bound)
-                break;
+        /* zero scores are still counted as matches */
+        for(size_t i = 0; i < pairs.count; i++)
+            if(pairs.scores[i] == 0)
+                pairs.scores[i] = FLT_MIN;
 
-            lowest_idx = query_index + 1;
+        score = assignment_score(reference, query, &pairs);
+    }
 
-            if(Min(query_mzs[query_index], query_mzs[query_index] + shift) < low_bound)
-                continue;
+    similarity_argument_free(fcinfo, 0, reference, &reference_buffer);
+    similarity_argument_free(fcinfo, 1, query, &query_buffer);
 
-            matches++;
-            score += calc_score(reference_peaks[reference_index], query_peaks[query_index],
-                    reference_mzs[reference_index], query_mzs[query_index], intensity_power, mz_power);
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
 
-            break;
-        }
-    }
+    PG_RETURN_FLOAT4(score);
+}
 
-    if(score != 0.0f)
-    {
-        float4 norm1 = calc_norm(reference_peaks, reference_mzs, reference_len, intensity_power, mz_power);
-        float4 norm2 = calc_norm(query_peaks, query_mzs, query_len, intensity_power, mz_power);
 
-        score /= sqrtf(norm1 * norm2);
-    }
+/*
+ * Tests whether the modified cosine score for the default powers exceeds the threshold, i.e. it is equivalent to
+ * cosine_modified(reference, query, shift, tolerance) > threshold, but most of the spectra that do not pass
+ * the threshold are rejected by the upper bound computed from the headers before any peaks are matched. Returns NULL
+ * if the score is not a number.
+ */
+PG_FUNCTION_INFO_V1(modified_cosine_above);
+Datum modified_cosine_above(PG_FUNCTION_ARGS)
+{
+    float4 shift = PG_GETARG_FLOAT4(2);
+    float4 tolerance = PG_GETARG_FLOAT4(3);
+    float4 threshold = PG_GETARG_FLOAT4(4);
+
+    scratch_begin();
+
+    WeightedSpectrum reference_buffer;
+    WeightedSpectrum query_buffer;
+    const WeightedSpectrum *reference = similarity_argument(fcinfo, 0, POWER_PRODUCT, 1, 0, &reference_buffer);
+    const WeightedSpectrum *query = similarity_argument(fcinfo, 1, POWER_PRODUCT, 1, 0, &query_buffer);
+
+    float4 score = 0;
+    bool rejected = false;
 
-    PG_FREE_IF_COPY(reference, 0);
-    PG_FREE_IF_COPY(query, 1);
+    /* negative scores are clamped, so they can still pass negative thresholds */
+    if(modified_disjoint(&reference->spectrum, &query->spectrum, shift, tolerance))
+        score = 0;
+    else if(threshold >= 0 && calc_upper_bound(&reference->spectrum, &query->spectrum, tolerance, shift) < threshold)
+        rejected = true;
+    else
+        score = modified_score(reference, query, shift, tolerance);
+
+    similarity_argument_free(fcinfo, 0, reference, &reference_buffer);
+    similarity_argument_free(fcinfo, 1, query, &query_buffer);
+
+    if(rejected)
+        PG_RETURN_BOOL(false);
 
     if(isfinite(score) && score < 0)
         score = 0;
@@ -93,5 +428,8 @@ Datum modified_cosine(PG_FUNCTION_ARGS)
     else if(!isfinite(score))
         score = NAN;
 
-    PG_RETURN_FLOAT4(score);
+    if(isnan(score))
+        PG_RETURN_NULL();
+
+    PG_RETURN_BOOL(score > threshold);
 }
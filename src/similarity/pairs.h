@@ -0,0 +1,97 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PAIRS_H
+#define PAIRS_H
+
+#include <postgres.h>
+#include "similarity/cosine.h"
+#include "similarity/scratch.h"
+
+
+/*
+ * Growing list of the pairs of peaks matched within the tolerance together with their scores, the arrays are taken
+ * from the scratch arena. The pairs are passed to the assignment solver, see lsap.h.
+ */
+typedef struct
+{
+    int *paired1;
+    int *paired2;
+    float *scores;
+    size_t count;
+    size_t capacity;
+}
+PairBuffer;
+
+
+static inline void pair_buffer_init(PairBuffer *buffer, size_t capacity)
+{
+    buffer->paired1 = scratch_alloc(capacity * sizeof(int));
+    buffer->paired2 = scratch_alloc(capacity * sizeof(int));
+    buffer->scores = scratch_alloc(capacity * sizeof(float));
+    buffer->count = 0;
+    buffer->capacity = capacity;
+}
+
+
+static pg_noinline void pair_buffer_enlarge(PairBuffer *buffer)
+{
+    PairBuffer enlarged;
+    pair_buffer_init(&enlarged, 2 * buffer->capacity);
+
+    memcpy(enlarged.paired1, buffer->paired1, buffer->count * sizeof(int));
+    memcpy(enlarged.paired2, buffer->paired2, buffer->count * sizeof(int));
+    memcpy(enlarged.scores, buffer->scores, buffer->count * sizeof(float));
+    enlarged.count = buffer->count;
+
+    *buffer = enlarged;
+}
+
+
+static inline void pair_buffer_add(PairBuffer *buffer, int index1, int index2, float score)
+{
+    if(unlikely(buffer->count == buffer->capacity))
+        pair_buffer_enlarge(buffer);
+
+    buffer->paired1[buffer->count] = index1;
+    buffer->paired2[buffer->count] = index2;
+    buffer->scores[buffer->count] = score;
+    buffer->count++;
+}
+
+
+/*
+ * Collects the pairs of peaks matched directly or after the shift is added to the m/z value of the query peak, a pair
+ * matched both ways is collected only once, see modified_cosine.c.
+ */
+size_t collect_modified_pairs(const WeightedSpectrum *reference, const WeightedSpectrum *query, float shift,
+        float tolerance, PairBuffer *pairs);
+
+/*
+ * Assigns the pairs greedily in the order of decreasing scores and returns the sum of the scores of the assigned pairs.
+ */
+float greedy_assignment(const PairBuffer *pairs, int count1, int count2);
+
+/*
+ * Finds the optimal assignment of the pairs and returns its score divided by the norms of the spectra, see
+ * cosine_hungarian.c. Zero scores have to be replaced by FLT_MIN, so that they are still counted as matches.
+ */
+float assignment_score(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, const PairBuffer *pairs);
+
+#endif /* PAIRS_H */
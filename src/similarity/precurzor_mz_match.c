@@ -25,7 +25,16 @@
 #include <fmgr.h>
 #include <math.h>
 #include <float.h>
+#include <access/stratnum.h>
 #include <catalog/namespace.h>
+#include <catalog/pg_am.h>
+#include <catalog/pg_type.h>
+#include <nodes/makefuncs.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/optimizer.h>
+#include <parser/parse_func.h>
+#include <utils/lsyscache.h>
 #include "enum.h"
 
 
@@ -48,6 +57,62 @@ static void init()
 }
 
 
+static bool precurzor_match(float query, float reference, float tolerance, Oid tolerance_type)
+{
+    float dif = fabsf(reference - query);
+
+    if(tolerance_type == dalton_oid)
+        return dif <= tolerance;
+    else if(tolerance_type == ppm_oid)
+        return dif / (fabsf(reference + query) / 2) * 1e6 <= tolerance;
+
+    return false;
+}
+
+
+/*
+ * Computes the range of m/z values matching the given one. The match is evaluated in float4, so the range is widened
+ * slightly to cover rounding errors.
+ */
+static void precurzor_bounds(float mz, float tolerance, Oid tolerance_type, float *lower, float *upper)
+{
+    double low = -INFINITY;
+    double high = INFINITY;
+
+    if(tolerance_type == dalton_oid)
+    {
+        low = (double) mz - tolerance;
+        high = (double) mz + tolerance;
+    }
+    else if(tolerance_type == ppm_oid)
+    {
+        double k = tolerance * 1e-6 / 2;
+
+        if(k < 0)
+        {
+            low = INFINITY;
+            high = -INFINITY;
+        }
+        else if(mz > 0 && k < 1)
+        {
+            low = mz * (1 - k) / (1 + k);
+            high = mz * (1 + k) / (1 - k);
+        }
+    }
+
+    double slack = (fabs(mz) + fabs(high - low)) * 1e-6;
+
+    if(isfinite(slack))
+    {
+        low -= slack;
+        high += slack;
+    }
+
+    *lower = low;
+    *upper = high;
+}
+
+
 PG_FUNCTION_INFO_V1(precurzor_mz_match);
 Datum precurzor_mz_match(PG_FUNCTION_ARGS)
 {
@@ -58,13 +123,123 @@ Datum precurzor_mz_match(PG_FUNCTION_ARGS)
     const float tolerance = PG_GETARG_FLOAT4(2);
     Oid tolerance_type = PG_GETARG_OID(3);
 
-    bool match = false;
-    float dif = abs(reference - query);
-
-    if(tolerance_type == dalton_oid)
-        match = (dif <= tolerance);
-    else if(tolerance_type == ppm_oid)
-        match = (dif / (abs(reference + query) / 2) * 1e6 <= tolerance);
+    bool match = precurzor_match(query, reference, tolerance, tolerance_type);
 
     PG_RETURN_FLOAT4(match ? 1.0f : 0.0f);
 }
+
+
+PG_FUNCTION_INFO_V1(precurzor_mz_within);
+Datum precurzor_mz_within(PG_FUNCTION_ARGS)
+{
+    init();
+
+    const float query = PG_GETARG_FLOAT4(0);
+    const float reference = PG_GETARG_FLOAT4(1);
+    const float tolerance = PG_GETARG_FLOAT4(2);
+    Oid tolerance_type = PG_GETARG_OID(3);
+
+    PG_RETURN_BOOL(precurzor_match(query, reference, tolerance, tolerance_type));
+}
+
+
+PG_FUNCTION_INFO_V1(precurzor_mz_lower);
+Datum precurzor_mz_lower(PG_FUNCTION_ARGS)
+{
+    init();
+
+    float lower;
+    float upper;
+    precurzor_bounds(PG_GETARG_FLOAT4(0), PG_GETARG_FLOAT4(1), PG_GETARG_OID(2), &lower, &upper);
+
+    PG_RETURN_FLOAT4(lower);
+}
+
+
+PG_FUNCTION_INFO_V1(precurzor_mz_upper);
+Datum precurzor_mz_upper(PG_FUNCTION_ARGS)
+{
+    init();
+
+    float lower;
+    float upper;
+    precurzor_bounds(PG_GETARG_FLOAT4(0), PG_GETARG_FLOAT4(1), PG_GETARG_OID(2), &lower, &upper);
+
+    PG_RETURN_FLOAT4(upper);
+}
+
+
+static Expr *precurzor_bound_expr(Oid funcid, const char *name, Node *mz, Node *tolerance, Node *tolerance_type)
+{
+    Oid argtypes[3] = { FLOAT4OID, FLOAT4OID, exprType(tolerance_type) };
+    char *nspname = get_namespace_name(get_func_namespace(funcid));
+
+    Oid boundid = LookupFuncName(list_make2(makeString(nspname), makeString(pstrdup(name))), 3, argtypes, true);
+
+    if(!OidIsValid(boundid))
+        return NULL;
+
+    return (Expr *) makeFuncExpr(boundid, FLOAT4OID, list_make3(copyObject(mz), copyObject(tolerance),
+            copyObject(tolerance_type)), InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+}
+
+
+/*
+ * Planner support function of precurzor_mz_within. If one of the compared m/z values is a float4 column indexed by
+ * btree, the call is turned into a (lossy) range condition on the column, so the precursor filtering can be done by
+ * an index scan.
+ */
+PG_FUNCTION_INFO_V1(precurzor_mz_support);
+Datum precurzor_mz_support(PG_FUNCTION_ARGS)
+{
+    Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+    if(!IsA(rawreq, SupportRequestIndexCondition))
+        PG_RETURN_POINTER(NULL);
+
+    SupportRequestIndexCondition *req = (SupportRequestIndexCondition *) rawreq;
+
+    if(!is_funcclause(req->node))
+        PG_RETURN_POINTER(NULL);
+
+    FuncExpr *clause = (FuncExpr *) req->node;
+    IndexOptInfo *index = req->index;
+
+    if(req->indexarg > 1 || list_length(clause->args) != 4 || index->relam != BTREE_AM_OID ||
+            index->opcintype[req->indexcol] != FLOAT4OID)
+        PG_RETURN_POINTER(NULL);
+
+    Node *column = (Node *) list_nth(clause->args, req->indexarg);
+    Node *mz = (Node *) list_nth(clause->args, 1 - req->indexarg);
+    Node *tolerance = (Node *) lthird(clause->args);
+    Node *tolerance_type = (Node *) lfourth(clause->args);
+
+#if PG_VERSION_NUM >= 140000
+    if(!is_pseudo_constant_for_index(req->root, mz, index) || !is_pseudo_constant_for_index(req->root, tolerance, index)
+            || !is_pseudo_constant_for_index(req->root, tolerance_type, index))
+#else
+    if(!is_pseudo_constant_for_index(mz, index) || !is_pseudo_constant_for_index(tolerance, index)
+            || !is_pseudo_constant_for_index(tolerance_type, index))
+#endif
+        PG_RETURN_POINTER(NULL);
+
+    Oid geopr = get_opfamily_member(req->opfamily, FLOAT4OID, FLOAT4OID, BTGreaterEqualStrategyNumber);
+    Oid leopr = get_opfamily_member(req->opfamily, FLOAT4OID, FLOAT4OID, BTLessEqualStrategyNumber);
+
+    if(!OidIsValid(geopr) || !OidIsValid(leopr))
+        PG_RETURN_POINTER(NULL);
+
+    Expr *lower = precurzor_bound_expr(clause->funcid, "precurzor_mz_lower", mz, tolerance, tolerance_type);
+    Expr *upper = precurzor_bound_expr(clause->funcid, "precurzor_mz_upper", mz, tolerance, tolerance_type);
+
+    if(lower == NULL || upper == NULL)
+        PG_RETURN_POINTER(NULL);
+
+    List *result = list_make2(
+            make_opclause(geopr, BOOLOID, false, (Expr *) copyObject(column), lower, InvalidOid, InvalidOid),
+            make_opclause(leopr, BOOLOID, false, (Expr *) copyObject(column), upper, InvalidOid, InvalidOid));
+
+    req->lossy = true;
+
+    PG_RETURN_POINTER(result);
+}
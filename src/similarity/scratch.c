@@ -0,0 +1,78 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#include <utils/memutils.h>
+#include "similarity/scratch.h"
+
+
+#define SCRATCH_MIN_SIZE    (64 * 1024)
+
+
+static char *block = NULL;
+static size_t block_size = 0;
+static size_t block_used = 0;
+static size_t requested = 0;
+static MemoryContext overflow_context = NULL;
+
+
+void scratch_begin(void)
+{
+    if(requested > block_size)
+    {
+        size_t size = Max(block_size, SCRATCH_MIN_SIZE);
+
+        while(size < requested)
+            size *= 2;
+
+        if(block != NULL)
+            pfree(block);
+
+        block = NULL;
+        block_size = 0;
+
+        block = MemoryContextAllocHuge(TopMemoryContext, size);
+        block_size = size;
+    }
+
+    if(overflow_context != NULL)
+        MemoryContextReset(overflow_context);
+
+    block_used = 0;
+    requested = 0;
+}
+
+
+void *scratch_alloc(size_t size)
+{
+    size = MAXALIGN(Max(size, 1));
+    requested += size;
+
+    if(block_used + size <= block_size)
+    {
+        void *result = block + block_used;
+        block_used += size;
+        return result;
+    }
+
+    if(overflow_context == NULL)
+        overflow_context = AllocSetContextCreate(TopMemoryContext, "pgms scratch overflow", ALLOCSET_DEFAULT_SIZES);
+
+    return MemoryContextAllocHuge(overflow_context, size);
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <postgres.h>
+
+
+/*
+ * Scratch memory of the similarity kernels. The memory is taken from a grow-only block, which is kept for the lifetime
+ * of the backend, so the kernels allocate nothing once the block is large enough for the largest inputs seen so far.
+ *
+ * scratch_begin() releases all the scratch memory obtained before, so it is called only at the beginning of the SQL
+ * callable functions, and the memory cannot be kept across calls. Requests exceeding the block are served from
+ * an overflow context, which is released by the next scratch_begin() that also enlarges the block accordingly.
+ */
+void scratch_begin(void);
+void *scratch_alloc(size_t size);
+
+#endif /* SCRATCH_H */
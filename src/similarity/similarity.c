@@ -0,0 +1,216 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <funcapi.h>
+#include <float.h>
+#include <math.h>
+#include <access/htup_details.h>
+#include "similarity/cache.h"
+#include "similarity/cosine.h"
+#include "similarity/lsap.h"
+#include "similarity/pairs.h"
+#include "similarity/scratch.h"
+
+
+#define SIMILARITY_ATTRIBUTES   5
+
+
+typedef struct
+{
+    float greedy;
+    float hungarian;
+    float modified;
+    float intersect;
+    int matches;
+}
+SimilarityScores;
+
+
+static inline float clamp_score(float score)
+{
+    if(isfinite(score) && score < 0)
+        score = 0;
+    else if(isfinite(score) && score > 1)
+        score = 1;
+    else if(!isfinite(score))
+        score = NAN;
+
+    return score;
+}
+
+
+/*
+ * Computes all scores from a single enumeration of the pairs of peaks within the tolerance. The greedy cosine score is
+ * accumulated during the enumeration in the same way as by its own kernel, and the number of the greedy matches equals
+ * the number of peaks counted by intersect_mz. The pairs are collected for the optimal assignment, which is solved only
+ * if the pair is not rejected by min_matches. Without the shift, they are also the pairs of the modified cosine score,
+ * otherwise its pairs matched directly or after the shift are collected separately. Returns false if the spectra have
+ * fewer than min_matches matched peaks.
+ */
+static bool similarity_scores(const WeightedSpectrum *spectrum1, const WeightedSpectrum *spectrum2, float shift,
+        float tolerance, int min_matches, SimilarityScores *result)
+{
+    int count1 = spectrum1->spectrum.count;
+    int count2 = spectrum2->spectrum.count;
+
+    memset(result, 0, sizeof(SimilarityScores));
+
+    if(Min(count1, count2) < min_matches)
+        return false;
+
+    /* the shifted peaks can still be matched */
+    if(spectrum_disjoint(&spectrum1->spectrum, &spectrum2->spectrum, tolerance))
+    {
+        if(min_matches > 0)
+            return false;
+
+        result->modified = shift != 0 ? modified_score(spectrum1, spectrum2, shift, tolerance) : 0;
+        return true;
+    }
+
+    PairBuffer pairs;
+    pair_buffer_init(&pairs, Max(count1, count2));
+
+    float greedy = 0;
+    int greedy_last = -1;
+
+    SpectrumCursor peak1;
+    SpectrumCursor lowest;
+    spectrum_cursor_init(&lowest, &spectrum2->spectrum);
+
+    for(spectrum_cursor_init(&peak1, &spectrum1->spectrum); spectrum_cursor_valid(&peak1); spectrum_cursor_next(&peak1))
+    {
+        float weight1 = spectrum_weight(spectrum1, peak1.index);
+        float low_bound = peak1.mz - tolerance;
+        float high_bound = peak1.mz + tolerance;
+        bool greedy_matched = false;
+
+        spectrum_cursor_skip(&lowest, low_bound);
+
+        for(SpectrumCursor peak2 = lowest; spectrum_cursor_valid(&peak2); spectrum_cursor_next(&peak2))
+        {
+            if(peak2.mz > high_bound)
+                break;
+
+            float s = weight1 * spectrum_weight(spectrum2, peak2.index);
+
+            if(!greedy_matched && peak2.index > greedy_last)
+            {
+                greedy += s;
+                greedy_last = peak2.index;
+                greedy_matched = true;
+                result->matches++;
+            }
+
+            pair_buffer_add(&pairs, peak1.index, peak2.index, s);
+        }
+    }
+
+    if(result->matches < min_matches)
+        return false;
+
+    float norm = sqrtf(spectrum1->norm * spectrum2->norm);
+
+    if(shift != 0)
+    {
+        result->modified = modified_score(spectrum1, spectrum2, shift, tolerance);
+    }
+    else if(pairs.count > 0)
+    {
+        float modified = greedy_assignment(&pairs, count1, count2);
+        result->modified = modified != 0 ? modified / norm : 0;
+    }
+
+    float hungarian = 0;
+    int hungarian_matches = 0;
+
+    /* zero scores are still counted as matches */
+    for(size_t i = 0; i < pairs.count; i++)
+        if(pairs.scores[i] == 0)
+            pairs.scores[i] = FLT_MIN;
+
+    if(pairs.count > 0)
+        solve_sparse_linear_sum_assignment(count1, count2, pairs.count, pairs.paired1, pairs.paired2, pairs.scores,
+                &hungarian_matches, &hungarian);
+
+    result->greedy = greedy != 0 ? greedy / norm : 0;
+    result->hungarian = hungarian != 0 ? hungarian / norm : 0;
+    result->intersect = result->matches == 0 ? 0 : result->matches / (float) (count1 + count2 - result->matches);
+
+    return true;
+}
+
+
+/*
+ * Computes cosine_greedy, cosine_hungarian, cosine_modified and intersect_mz scores of the spectra together with
+ * the number of matched peaks at once, the spectra are detoasted and weighted only once and the pairs of peaks are
+ * enumerated only once. Returns NULL if the spectra have fewer than min_matches matched peaks.
+ */
+PG_FUNCTION_INFO_V1(similarity);
+Datum similarity(PG_FUNCTION_ARGS)
+{
+    float shift = PG_GETARG_FLOAT4(2);
+    float tolerance = PG_GETARG_FLOAT4(3);
+    float mz_power = PG_GETARG_FLOAT4(4);
+    float intensity_power = PG_GETARG_FLOAT4(5);
+    int min_matches = PG_GETARG_INT32(6);
+
+    TupleDesc tupdesc;
+
+    if(get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        elog(ERROR, "return type must be a row type");
+
+    if(tupdesc->natts != SIMILARITY_ATTRIBUTES)
+        elog(ERROR, "return type must have %i attributes", SIMILARITY_ATTRIBUTES);
+
+    PowerKind kind = power_kind(intensity_power, mz_power);
+
+    scratch_begin();
+
+    WeightedSpectrum buffer1;
+    WeightedSpectrum buffer2;
+    const WeightedSpectrum *spectrum1 = similarity_argument(fcinfo, 0, kind, intensity_power, mz_power, &buffer1);
+    const WeightedSpectrum *spectrum2 = similarity_argument(fcinfo, 1, kind, intensity_power, mz_power, &buffer2);
+
+    SimilarityScores scores;
+    bool matched = similarity_scores(spectrum1, spectrum2, shift, tolerance, min_matches, &scores);
+
+    similarity_argument_free(fcinfo, 0, spectrum1, &buffer1);
+    similarity_argument_free(fcinfo, 1, spectrum2, &buffer2);
+
+    if(!matched)
+        PG_RETURN_NULL();
+
+    Datum values[SIMILARITY_ATTRIBUTES];
+    bool nulls[SIMILARITY_ATTRIBUTES] = { false };
+
+    values[0] = Float4GetDatum(clamp_score(scores.greedy));
+    values[1] = Float4GetDatum(clamp_score(scores.hungarian));
+    values[2] = Float4GetDatum(clamp_score(scores.modified));
+    values[3] = Float4GetDatum(scores.intersect);
+    values[4] = Int32GetDatum(scores.matches);
+
+    HeapTuple tuple = heap_form_tuple(BlessTupleDesc(tupdesc), values, nulls);
+    PG_RETURN_DATUM(HeapTupleGetDatum(tuple));
+}
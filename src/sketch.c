@@ -0,0 +1,238 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <catalog/pg_type.h>
+#include <common/hashfn.h>
+#include <utils/array.h>
+#include "spectrum.h"
+
+
+/*
+ * Sketches are MinHash signatures of the sets of m/z bins of spectra. The i-th value of the sketch is the minimum
+ * of the i-th hash function over the bins, where the hash functions are multiply-shift hashes of a hash of the bin.
+ * The hashes do not depend on the platform, so the sketches can be stored and indexed. The sketch of an empty spectrum
+ * consists of SKETCH_EMPTY values.
+ */
+#define SKETCH_SEED             0x50474D53
+#define SKETCH_EMPTY            -1
+#define MAX_SKETCH_HASHES       1024
+
+
+/*
+ * Returns the bin of the m/z value, the bins of huge values are clamped. The m/z value must be finite.
+ */
+static inline int32 mz_bin(float4 mz, float4 bin_width)
+{
+    double bin = floor(mz / bin_width);
+
+    if(bin < PG_INT32_MIN)
+        return PG_INT32_MIN;
+    else if(bin > PG_INT32_MAX)
+        return PG_INT32_MAX;
+
+    return (int32) bin;
+}
+
+
+static int32 *sketch_values(ArrayType *sketch, int *count)
+{
+    if(ARR_NDIM(sketch) > 1)
+        ereport(ERROR, (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR), errmsg("sketch must be one-dimensional array")));
+
+    if(array_contains_nulls(sketch))
+        ereport(ERROR, (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED), errmsg("sketch must not contain nulls")));
+
+    *count = ArrayGetNItems(ARR_NDIM(sketch), ARR_DIMS(sketch));
+
+    return (int32 *) ARR_DATA_PTR(sketch);
+}
+
+
+/*
+ * Returns the fraction of the hash functions whose minima are equal in both sketches, which is an unbiased estimate
+ * of the Jaccard index of the sets of bins.
+ */
+static float4 sketch_jaccard(FunctionCallInfo fcinfo)
+{
+    ArrayType *sketch1 = PG_GETARG_ARRAYTYPE_P(0);
+    ArrayType *sketch2 = PG_GETARG_ARRAYTYPE_P(1);
+
+    int count1;
+    int count2;
+    int32 *values1 = sketch_values(sketch1, &count1);
+    int32 *values2 = sketch_values(sketch2, &count2);
+
+    if(count1 != count2)
+        ereport(ERROR, (errcode(ERRCODE_DATA_EXCEPTION), errmsg("different sketch sizes %d and %d", count1, count2)));
+
+    int equal = 0;
+
+    for(int i = 0; i < count1; i++)
+        if(values1[i] == values2[i] && values1[i] != SKETCH_EMPTY)
+            equal++;
+
+    PG_FREE_IF_COPY(sketch1, 0);
+    PG_FREE_IF_COPY(sketch2, 1);
+
+    return count1 > 0 ? equal / (float4) count1 : 0;
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_sketch);
+Datum spectrum_sketch(PG_FUNCTION_ARGS)
+{
+    int32 hashes = PG_GETARG_INT32(1);
+    float4 bin_width = PG_GETARG_FLOAT4(2);
+
+    if(hashes < 1 || hashes > MAX_SKETCH_HASHES)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("number of hashes must be between 1 and %d", MAX_SKETCH_HASHES)));
+
+    if(!isfinite(bin_width) || bin_width <= 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("bin width must be a positive number")));
+
+    Spectrum spectrum;
+    void *value = spectrum_detoast_mz(PG_GETARG_DATUM(0), &spectrum);
+
+    uint64 *multipliers = palloc(hashes * sizeof(uint64));
+    uint64 *increments = palloc(hashes * sizeof(uint64));
+    uint32 *minima = palloc(hashes * sizeof(uint32));
+
+    for(int i = 0; i < hashes; i++)
+    {
+        multipliers[i] = hash_bytes_uint32_extended(i, SKETCH_SEED + 1) | 1;
+        increments[i] = hash_bytes_uint32_extended(i, SKETCH_SEED + 2);
+        minima[i] = (uint32) SKETCH_EMPTY;
+    }
+
+    bool empty = true;
+    int32 last = 0;
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        /* non-finite m/z values have no bin, such peaks are not part of the sketch */
+        if(!isfinite(cursor.mz))
+            continue;
+
+        int32 bin = mz_bin(cursor.mz, bin_width);
+
+        if(!empty && bin == last)
+            continue;
+
+        uint64 hash = hash_bytes_uint32_extended((uint32) bin, SKETCH_SEED);
+
+        for(int i = 0; i < hashes; i++)
+        {
+            uint32 value = (multipliers[i] * hash + increments[i]) >> 32;
+
+            if(value < minima[i])
+                minima[i] = value;
+        }
+
+        empty = false;
+        last = bin;
+    }
+
+    Datum *elements = palloc(hashes * sizeof(Datum));
+
+    for(int i = 0; i < hashes; i++)
+        elements[i] = Int32GetDatum((int32) minima[i]);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_ARRAYTYPE_P(construct_array(elements, hashes, INT4OID, sizeof(int32), true, TYPALIGN_INT));
+}
+
+
+/*
+ * Splits the sketch into bands of consecutive values and returns hashes of the bands. Spectra sharing a band hash
+ * are the candidate pairs of the banded LSH, so the candidates can be found by the && operator, which can be evaluated
+ * by a GIN index on the band hashes. The band number is the seed of its hash, so equal values in different bands do
+ * not collide, and the hash of each value is the seed of the hash of the next one. An empty spectrum has no bands.
+ */
+PG_FUNCTION_INFO_V1(sketch_bands);
+Datum sketch_bands(PG_FUNCTION_ARGS)
+{
+    ArrayType *sketch = PG_GETARG_ARRAYTYPE_P(0);
+    int32 bands = PG_GETARG_INT32(1);
+
+    int count;
+    int32 *values = sketch_values(sketch, &count);
+
+    if(bands < 1 || count % bands != 0)
+        ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE), errmsg("number of bands must be a positive divisor of the sketch size %d", count)));
+
+    int rows = count / bands;
+    bool empty = true;
+
+    for(int i = 0; i < count; i++)
+        if(values[i] != SKETCH_EMPTY)
+            empty = false;
+
+    if(empty)
+        bands = 0;
+
+    Datum *elements = palloc(Max(bands, 1) * sizeof(Datum));
+
+    for(int i = 0; i < bands; i++)
+    {
+        uint64 hash = i;
+
+        /* the values are hashed one by one, hashing of their bytes would depend on the byte order */
+        for(int j = 0; j < rows; j++)
+            hash = hash_bytes_uint32_extended((uint32) values[i * rows + j], hash);
+
+        elements[i] = Int64GetDatum(hash);
+    }
+
+    PG_FREE_IF_COPY(sketch, 0);
+    PG_RETURN_ARRAYTYPE_P(construct_array(elements, bands, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, TYPALIGN_DOUBLE));
+}
+
+
+/*
+ * Estimates intersect_mz score of the spectra, i.e. the Jaccard index of their peaks, by the Jaccard index of their
+ * sets of bins.
+ */
+PG_FUNCTION_INFO_V1(sketch_intersect_mz);
+Datum sketch_intersect_mz(PG_FUNCTION_ARGS)
+{
+    PG_RETURN_FLOAT4(sketch_jaccard(fcinfo));
+}
+
+
+/*
+ * Estimates cosine greedy score of the spectra by the cosine score of their sets of bins with unit intensities.
+ * The sizes of the sets are not known, so they are assumed to be equal, and the score equals 2J / (1 + J) for
+ * the Jaccard index J then. Sets of different sizes with the same Jaccard index have a higher cosine score, so
+ * the estimate is a lower bound that never overestimates the cosine score of the sets.
+ */
+PG_FUNCTION_INFO_V1(sketch_cosine_greedy);
+Datum sketch_cosine_greedy(PG_FUNCTION_ARGS)
+{
+    float4 jaccard = sketch_jaccard(fcinfo);
+
+    PG_RETURN_FLOAT4(2 * jaccard / (1 + jaccard));
+}
@@ -23,12 +23,27 @@
 #include <varatt.h>
 #endif
 #include <fmgr.h>
+#include <access/detoast.h>
+#include <common/hashfn.h>
 #include <common/shortest_dec.h>
+#include <lib/hyperloglog.h>
+#include <libpq/pqformat.h>
+#include <port/pg_bswap.h>
 #include <utils/builtins.h>
 #include <utils/float.h>
+#include <utils/sortsupport.h>
 #include "spectrum.h"
 
 
+typedef struct
+{
+    bool estimating;
+    int64 input_count;
+    hyperLogLogState abbr_card;
+}
+SpectrumSortSupport;
+
+
 static int spectrum_peak_cmp(const void *l, const void *r)
 {
     SpectrumPeak *l_value = (SpectrumPeak *) l;
@@ -37,26 +52,220 @@ static int spectrum_peak_cmp(const void *l, const void *r)
 }
 
 
-Datum create_spectrum(SpectrumPeak *data, int count)
+/*
+ * Allocates a spectrum value in the SPECTRUM_FLOAT format. The caller fills in the returned arrays of m/z values and
+ * intensities and then calls spectrum_fill_header().
+ */
+static void *allocate_spectrum(int count, float4 **data)
 {
-    qsort(data, count, sizeof(SpectrumPeak), spectrum_peak_cmp);
-
-    size_t size = 2 * count * sizeof(float4) + VARHDRSZ;
+    size_t size = VARHDRSZ + sizeof(SpectrumHeader) + 2 * count * sizeof(float4);
 
     void *result = palloc0(size);
-    float4 *result_data = (float4*) VARDATA(result);
+    SpectrumHeader *header = (SpectrumHeader *) VARDATA(result);
     SET_VARSIZE(result, size);
 
+    header->magic = SPECTRUM_MAGIC | SPECTRUM_FLOAT;
+    header->count = count;
+
+    *data = (float4 *) (header + 1);
+    return result;
+}
+
+
+/*
+ * Computes the statistics of the header. The count, and in the case of the compact format also the maximal
+ * intensity, have to be already set.
+ */
+static void spectrum_fill_header(void *value)
+{
+    SpectrumHeader *header = (SpectrumHeader *) VARDATA(value);
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    header->mz_min = 0;
+    header->mz_max = 0;
+    header->norm = 0;
+    memset(header->top_mz, 0, sizeof(header->top_mz));
+    memset(header->top_intensity, 0, sizeof(header->top_intensity));
+
+    float4 max = 0;
+    int top = 0;
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        float4 intensity = spectrum_intensity(&spectrum, cursor.index);
+
+        if(cursor.index == 0)
+            header->mz_min = cursor.mz;
+
+        header->mz_max = cursor.mz;
+        header->norm += intensity * intensity;
+
+        if(max < intensity)
+            max = intensity;
+
+        /* keep the top peaks ordered by descending intensity */
+        if(top < SPECTRUM_TOP_PEAKS || intensity > header->top_intensity[top - 1])
+        {
+            int i = top < SPECTRUM_TOP_PEAKS ? top++ : top - 1;
+
+            for(; i > 0 && header->top_intensity[i - 1] < intensity; i--)
+            {
+                header->top_mz[i] = header->top_mz[i - 1];
+                header->top_intensity[i] = header->top_intensity[i - 1];
+            }
+
+            header->top_mz[i] = cursor.mz;
+            header->top_intensity[i] = intensity;
+        }
+    }
+
+    if(spectrum.format != SPECTRUM_COMPACT)
+        header->intensity_max = max;
+}
+
+
+/*
+ * Detoasts only the leading part of the value that holds the header, so the format and the number of peaks are known
+ * without decompressing or fetching the whole value. The returned view provides neither m/z values nor intensities.
+ */
+static void *spectrum_detoast_head(Datum datum, Spectrum *spectrum)
+{
+    void *value = PG_DETOAST_DATUM_SLICE(datum, 0, sizeof(SpectrumHeader));
+    const SpectrumHeader *header = (const SpectrumHeader *) VARDATA(value);
+
+    memset(spectrum, 0, sizeof(Spectrum));
+
+    if(VARSIZE(value) - VARHDRSZ >= sizeof(SpectrumHeader) && (header->magic & SPECTRUM_MAGIC_MASK) == SPECTRUM_MAGIC)
+    {
+        spectrum->format = header->magic & ~SPECTRUM_MAGIC_MASK;
+        spectrum->header = header;
+        spectrum->count = header->count;
+    }
+    else
+    {
+        spectrum->format = SPECTRUM_RAW;
+        spectrum->count = (toast_raw_datum_size(datum) - VARHDRSZ) / sizeof(float4) / 2;
+    }
+
+    return value;
+}
+
+
+void *spectrum_detoast_mz(Datum datum, Spectrum *spectrum)
+{
+    void *value = DatumGetPointer(datum);
+
+    if(!VARATT_IS_EXTERNAL(value) && !VARATT_IS_COMPRESSED(value))
+    {
+        value = PG_DETOAST_DATUM(datum);
+        spectrum_open(spectrum, value);
+        return value;
+    }
+
+    void *head = spectrum_detoast_head(datum, spectrum);
+    SpectrumFormat format = spectrum->format;
+    int count = spectrum->count;
+
+    if((Pointer) head != DatumGetPointer(datum))
+        pfree(head);
+
+    /* m/z values precede intensities in all formats and take four bytes per peak */
+    size_t offset = format == SPECTRUM_RAW ? 0 : sizeof(SpectrumHeader);
+    size_t size = offset + count * sizeof(float4);
+
+    value = PG_DETOAST_DATUM_SLICE(datum, 0, size);
+
+    if(VARSIZE(value) - VARHDRSZ != size)
+        elog(ERROR, "corrupted spectrum value");
+
+    memset(spectrum, 0, sizeof(Spectrum));
+    spectrum->format = format;
+    spectrum->count = count;
+
+    if(format != SPECTRUM_RAW)
+        spectrum->header = (const SpectrumHeader *) VARDATA(value);
+
+    if(format == SPECTRUM_COMPACT)
+        spectrum->mz_planes = (const uint8 *) VARDATA(value) + offset;
+    else
+        spectrum->mz = (const float4 *) (VARDATA(value) + offset);
+
+    return value;
+}
+
+
+Datum create_spectrum(SpectrumPeak *data, int count)
+{
+    qsort(data, count, sizeof(SpectrumPeak), spectrum_peak_cmp);
+
+    float4 *result_data;
+    void *result = allocate_spectrum(count, &result_data);
+
     for(size_t i = 0; i < count; i++)
     {
         result_data[i] = data[i].mz;
         result_data[count + i] = data[i].intenzity;
     }
 
+    spectrum_fill_header(result);
+
     PG_RETURN_POINTER(result);
 }
 
 
+/*
+ * Returns the part of the value that identifies the spectrum. Spectra in the float formats are identified by their
+ * arrays regardless of the header, spectra in the compact format by the whole value following the magic.
+ */
+static size_t spectrum_payload(const void *value, const Spectrum *spectrum, const void **data)
+{
+    if(spectrum->format == SPECTRUM_COMPACT)
+    {
+        *data = VARDATA(value) + sizeof(uint32);
+        return VARSIZE(value) - VARHDRSZ - sizeof(uint32);
+    }
+    else
+    {
+        *data = spectrum->mz;
+        return 2 * spectrum->count * sizeof(float4);
+    }
+}
+
+
+/*
+ * Compares spectra in the same way as the original bytea-based comparison of the headerless format, so the order
+ * of existing btree indexes is preserved. Spectra in the compact format are ordered after the others.
+ */
+static int spectrum_cmp(const void *value1, const void *value2)
+{
+    Spectrum spectrum1;
+    Spectrum spectrum2;
+    spectrum_open(&spectrum1, value1);
+    spectrum_open(&spectrum2, value2);
+
+    bool compact1 = spectrum1.format == SPECTRUM_COMPACT;
+    bool compact2 = spectrum2.format == SPECTRUM_COMPACT;
+
+    if(compact1 != compact2)
+        return compact1 ? 1 : -1;
+
+    const void *data1;
+    const void *data2;
+    size_t size1 = spectrum_payload(value1, &spectrum1, &data1);
+    size_t size2 = spectrum_payload(value2, &spectrum2, &data2);
+
+    int cmp = memcmp(data1, data2, Min(size1, size2));
+
+    if(cmp == 0 && size1 != size2)
+        cmp = size1 < size2 ? -1 : 1;
+
+    return cmp;
+}
+
+
 static void skip_blank(char **data)
 {
     while(**data != '\0' && isspace((unsigned char) **data))
@@ -183,43 +392,279 @@ Datum spectrum_input(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(spectrum_output);
 Datum spectrum_output(PG_FUNCTION_ARGS)
 {
-    void *spectrum = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
 
-    size_t count = (VARSIZE(spectrum) - VARHDRSZ) / sizeof(float4) / 2;
-    float4 *values = (float4 *) VARDATA(spectrum);
+    size_t count = spectrum.count;
 
     char *result = (char *) palloc0(count ? 2 * count * (FLOAT_SHORTEST_DECIMAL_LEN + 1) : 1);
     char *buffer = result;
 
-    for(size_t i = 0; i < count; i++)
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
     {
-        buffer += float_to_shortest_decimal_bufn(values[i], buffer);
+        buffer += float_to_shortest_decimal_bufn(cursor.mz, buffer);
         *(buffer++) = ':';
-        buffer += float_to_shortest_decimal_bufn(values[count + i], buffer);
+        buffer += float_to_shortest_decimal_bufn(spectrum_intensity(&spectrum, cursor.index), buffer);
         *(buffer++) = ' ';
     }
 
     *(count ? buffer - 1 : buffer) = '\0';
 
-    PG_FREE_IF_COPY(spectrum, 0);
+    PG_FREE_IF_COPY(value, 0);
     PG_RETURN_CSTRING(result);
 }
 
 
+PG_FUNCTION_INFO_V1(spectrum_send);
+Datum spectrum_send(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    StringInfoData buffer;
+    pq_begintypsend(&buffer);
+    enlargeStringInfo(&buffer, sizeof(int32) + 2 * spectrum.count * sizeof(float4));
+
+    pq_sendint32(&buffer, spectrum.count);
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+        pq_sendfloat4(&buffer, cursor.mz);
+
+    for(int i = 0; i < spectrum.count; i++)
+        pq_sendfloat4(&buffer, spectrum_intensity(&spectrum, i));
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_BYTEA_P(pq_endtypsend(&buffer));
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_recv);
+Datum spectrum_recv(PG_FUNCTION_ARGS)
+{
+    StringInfo buffer = (StringInfo) PG_GETARG_POINTER(0);
+
+    int32 count = (int32) pq_getmsgint(buffer, sizeof(int32));
+
+    if(count < 0 || count > (buffer->len - buffer->cursor) / (2 * sizeof(float4)))
+        ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("invalid number of peaks in external spectrum value")));
+
+    float4 *result_data;
+    void *result = allocate_spectrum(count, &result_data);
+
+    for(size_t i = 0; i < 2 * count; i++)
+        result_data[i] = pq_getmsgfloat4(buffer);
+
+    for(size_t i = 0; i < count; i++)
+        if(isnan(result_data[i]) || (i > 0 && result_data[i] < result_data[i - 1]))
+            ereport(ERROR, (errcode(ERRCODE_INVALID_BINARY_REPRESENTATION), errmsg("m/z values of external spectrum value are not sorted")));
+
+    spectrum_fill_header(result);
+
+    PG_RETURN_POINTER(result);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_compact);
+Datum spectrum_compact(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    if(spectrum.format == SPECTRUM_COMPACT)
+        PG_RETURN_POINTER(value);
+
+    int count = spectrum.count;
+    float4 max = 0.0f;
+
+    for(int i = 0; i < count; i++)
+    {
+        float4 intensity = spectrum_intensity(&spectrum, i);
+
+        if(!isfinite(intensity) || intensity < 0)
+            ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE), errmsg("spectrum intensity %g cannot be stored in the compact format", intensity)));
+
+        if(max < intensity)
+            max = intensity;
+    }
+
+    size_t size = VARHDRSZ + sizeof(SpectrumHeader) + count * (sizeof(uint32) + sizeof(uint16));
+
+    void *result = palloc0(size);
+    SpectrumHeader *header = (SpectrumHeader *) VARDATA(result);
+    uint8 *mz_planes = (uint8 *) (header + 1);
+    uint8 *intensity_planes = mz_planes + count * sizeof(uint32);
+    SET_VARSIZE(result, size);
+
+    header->magic = SPECTRUM_MAGIC | SPECTRUM_COMPACT;
+    header->count = count;
+    header->intensity_max = max;
+
+    uint32 previous = 0;
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        int i = cursor.index;
+        double fixed = rint(cursor.mz / SPECTRUM_MZ_RESOLUTION);
+
+        if(!(fixed >= previous && fixed <= PG_UINT32_MAX))
+            ereport(ERROR, (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE), errmsg("spectrum m/z value %g cannot be stored in the compact format", cursor.mz)));
+
+        uint32 delta = (uint32) fixed - previous;
+        previous = (uint32) fixed;
+
+        mz_planes[i] = delta;
+        mz_planes[count + i] = delta >> 8;
+        mz_planes[2 * count + i] = delta >> 16;
+        mz_planes[3 * count + i] = delta >> 24;
+
+        uint16 level = max > 0 ? (uint16) rintf(spectrum_intensity(&spectrum, i) / max * SPECTRUM_INTENSITY_LEVELS) : 0;
+
+        intensity_planes[i] = level;
+        intensity_planes[count + i] = level >> 8;
+    }
+
+    spectrum_fill_header(result);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_POINTER(result);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_expand);
+Datum spectrum_expand(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    if(spectrum.format == SPECTRUM_FLOAT)
+        PG_RETURN_POINTER(value);
+
+    size_t count = spectrum.count;
+
+    float4 *result_data;
+    void *result = allocate_spectrum(count, &result_data);
+
+    SpectrumCursor cursor;
+
+    for(spectrum_cursor_init(&cursor, &spectrum); spectrum_cursor_valid(&cursor); spectrum_cursor_next(&cursor))
+    {
+        result_data[cursor.index] = cursor.mz;
+        result_data[count + cursor.index] = spectrum_intensity(&spectrum, cursor.index);
+    }
+
+    spectrum_fill_header(result);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_POINTER(result);
+}
+
+
 PG_FUNCTION_INFO_V1(spectrum_max_intensity);
 Datum spectrum_max_intensity(PG_FUNCTION_ARGS)
 {
-    void *spectrum = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    Spectrum spectrum;
+    void *head = spectrum_detoast_head(PG_GETARG_DATUM(0), &spectrum);
 
-    size_t size = (VARSIZE(spectrum) - VARHDRSZ) / sizeof(float4);
-    size_t count = size / 2;
-    float4 *values = (float4 *) VARDATA(spectrum);
-    float4 max = 0.0f;
+    if(spectrum.header)
+    {
+        float4 max = spectrum.header->intensity_max;
+
+        PG_FREE_IF_COPY(head, 0);
+        PG_RETURN_FLOAT4(max);
+    }
+
+    PG_FREE_IF_COPY(head, 0);
+
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    spectrum_open(&spectrum, value);
+
+    float4 max = simd.max(spectrum.intensity, spectrum.count);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_FLOAT4(max);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_peak_count);
+Datum spectrum_peak_count(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum;
+    void *head = spectrum_detoast_head(PG_GETARG_DATUM(0), &spectrum);
+
+    PG_FREE_IF_COPY(head, 0);
+    PG_RETURN_INT32(spectrum.count);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_min_mz);
+Datum spectrum_min_mz(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum;
+    void *head = spectrum_detoast_head(PG_GETARG_DATUM(0), &spectrum);
+
+    if(spectrum.count == 0)
+    {
+        PG_FREE_IF_COPY(head, 0);
+        PG_RETURN_NULL();
+    }
+
+    if(spectrum.header)
+    {
+        float4 min = spectrum.header->mz_min;
+
+        PG_FREE_IF_COPY(head, 0);
+        PG_RETURN_FLOAT4(min);
+    }
+
+    PG_FREE_IF_COPY(head, 0);
+
+    void *slice = PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), 0, sizeof(float4));
+    float4 min = *(float4 *) VARDATA(slice);
+
+    PG_FREE_IF_COPY(slice, 0);
+    PG_RETURN_FLOAT4(min);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_max_mz);
+Datum spectrum_max_mz(PG_FUNCTION_ARGS)
+{
+    Spectrum spectrum;
+    void *head = spectrum_detoast_head(PG_GETARG_DATUM(0), &spectrum);
 
-    for(size_t i = count; i < size; i++)
-        if(max < values[i])
-            max = values[i];
+    if(spectrum.count == 0)
+    {
+        PG_FREE_IF_COPY(head, 0);
+        PG_RETURN_NULL();
+    }
+
+    if(spectrum.header)
+    {
+        float4 max = spectrum.header->mz_max;
+
+        PG_FREE_IF_COPY(head, 0);
+        PG_RETURN_FLOAT4(max);
+    }
+
+    PG_FREE_IF_COPY(head, 0);
+
+    void *slice = PG_DETOAST_DATUM_SLICE(PG_GETARG_DATUM(0), (spectrum.count - 1) * sizeof(float4), sizeof(float4));
+    float4 max = *(float4 *) VARDATA(slice);
 
+    PG_FREE_IF_COPY(slice, 0);
     PG_RETURN_FLOAT4(max);
 }
 
@@ -227,71 +672,304 @@ Datum spectrum_max_intensity(PG_FUNCTION_ARGS)
 PG_FUNCTION_INFO_V1(spectrum_normalize);
 Datum spectrum_normalize(PG_FUNCTION_ARGS)
 {
-    void *spectrum = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
-    size_t size = (VARSIZE(spectrum) - VARHDRSZ) / sizeof(float4);
-    size_t count = size / 2;
-    float4 *values = (float4 *) VARDATA(spectrum);
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
 
-    float4 max = DatumGetFloat4(DirectFunctionCall1(spectrum_max_intensity, PG_GETARG_DATUM(0)));
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
 
-    Datum result = (Datum) palloc0(VARSIZE(spectrum));
-    float4 *result_values = (float4 *) VARDATA(result);
-    SET_VARSIZE(result, VARSIZE(spectrum));
+    float4 max = DatumGetFloat4(DirectFunctionCall1(spectrum_max_intensity, PointerGetDatum(value)));
 
-    for(size_t i = 0; i < count; i++)
+    void *result;
+
+    if(spectrum.format == SPECTRUM_COMPACT)
     {
-        result_values[i] = values[i];
-        result_values[count + i] = values[count + i] / max;
+        result = palloc(VARSIZE(value));
+        memcpy(result, value, VARSIZE(value));
+
+        /* quantized intensities are already relative to the maximal intensity */
+        ((SpectrumHeader *) VARDATA(result))->intensity_max = max > 0 ? 1.0f : 0.0f;
     }
+    else
+    {
+        size_t count = spectrum.count;
 
-    PG_RETURN_DATUM(result);
+        float4 *result_values;
+        result = allocate_spectrum(count, &result_values);
+
+        for(size_t i = 0; i < count; i++)
+        {
+            result_values[i] = spectrum.mz[i];
+            result_values[count + i] = spectrum.intensity[i] / max;
+        }
+    }
+
+    spectrum_fill_header(result);
+
+    PG_RETURN_POINTER(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_equal_to);
 Datum spectrum_is_equal_to(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteaeq, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) == 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_not_equal_to);
 Datum spectrum_is_not_equal_to(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteane, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) != 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_less_than);
 Datum spectrum_is_less_than(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(bytealt, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) < 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_greater_than);
 Datum spectrum_is_greater_than(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteagt, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) > 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_not_less_than);
 Datum spectrum_is_not_less_than(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteage, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) >= 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_is_not_greater_than);
 Datum spectrum_is_not_greater_than(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteale, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    bool result = spectrum_cmp(value1, value2) <= 0;
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_BOOL(result);
 }
 
 
 PG_FUNCTION_INFO_V1(spectrum_compare);
 Datum spectrum_compare(PG_FUNCTION_ARGS)
 {
-    PG_RETURN_DATUM(DirectFunctionCall2(byteacmp, PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
+    void *value1 = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+    void *value2 = PG_DETOAST_DATUM(PG_GETARG_DATUM(1));
+
+    int result = spectrum_cmp(value1, value2);
+
+    PG_FREE_IF_COPY(value1, 0);
+    PG_FREE_IF_COPY(value2, 1);
+
+    PG_RETURN_INT32(result);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_hash);
+Datum spectrum_hash(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    const void *data;
+    size_t size = spectrum_payload(value, &spectrum, &data);
+
+    Datum result = hash_any((const unsigned char *) data, size);
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_DATUM(result);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_hash_extended);
+Datum spectrum_hash_extended(PG_FUNCTION_ARGS)
+{
+    void *value = PG_DETOAST_DATUM(PG_GETARG_DATUM(0));
+
+    Spectrum spectrum;
+    spectrum_open(&spectrum, value);
+
+    const void *data;
+    size_t size = spectrum_payload(value, &spectrum, &data);
+
+    Datum result = hash_any_extended((const unsigned char *) data, size, PG_GETARG_INT64(1));
+
+    PG_FREE_IF_COPY(value, 0);
+    PG_RETURN_DATUM(result);
+}
+
+
+static int spectrum_fastcmp(Datum x, Datum y, SortSupport ssup)
+{
+    void *value1 = PG_DETOAST_DATUM(x);
+    void *value2 = PG_DETOAST_DATUM(y);
+
+    int result = spectrum_cmp(value1, value2);
+
+    if((Pointer) value1 != DatumGetPointer(x))
+        pfree(value1);
+
+    if((Pointer) value2 != DatumGetPointer(y))
+        pfree(value2);
+
+    return result;
+}
+
+
+static int spectrum_abbrev_cmp(Datum x, Datum y, SortSupport ssup)
+{
+    return x == y ? 0 : (x < y ? -1 : 1);
+}
+
+
+/*
+ * The abbreviated key consists of a byte distinguishing the compact format followed by the leading bytes of the
+ * payload compared by spectrum_cmp(). It is built from a slice of the value, so external and compressed values are
+ * not detoasted completely.
+ */
+static Datum spectrum_abbrev_convert(Datum original, SortSupport ssup)
+{
+    SpectrumSortSupport *state = (SpectrumSortSupport *) ssup->ssup_extra;
+    void *value = DatumGetPointer(original);
+
+    if(VARATT_IS_EXTENDED(value))
+        value = PG_DETOAST_DATUM_SLICE(original, 0, sizeof(SpectrumHeader) + sizeof(Datum));
+
+    size_t size = VARSIZE(value) - VARHDRSZ;
+    const uint8 *data = (const uint8 *) VARDATA(value);
+    const SpectrumHeader *header = (const SpectrumHeader *) data;
+    size_t offset = 0;
+
+    Datum result = 0;
+    uint8 *key = (uint8 *) &result;
+
+    if(size >= sizeof(SpectrumHeader) && (header->magic & SPECTRUM_MAGIC_MASK) == SPECTRUM_MAGIC)
+    {
+        if((header->magic & ~SPECTRUM_MAGIC_MASK) == SPECTRUM_COMPACT)
+        {
+            key[0] = 1;
+            offset = sizeof(uint32);
+        }
+        else
+        {
+            offset = sizeof(SpectrumHeader);
+        }
+    }
+
+    memcpy(key + 1, data + offset, Min(sizeof(Datum) - 1, size - offset));
+
+    result = DatumBigEndianToNative(result);
+
+    if(state->estimating)
+    {
+        uint32 tmp = (uint32) result ^ (uint32) ((uint64) result >> 32);
+        addHyperLogLog(&state->abbr_card, DatumGetUInt32(hash_uint32(tmp)));
+    }
+
+    state->input_count++;
+
+    if((Pointer) value != DatumGetPointer(original))
+        pfree(value);
+
+    return result;
+}
+
+
+static bool spectrum_abbrev_abort(int memtupcount, SortSupport ssup)
+{
+    SpectrumSortSupport *state = (SpectrumSortSupport *) ssup->ssup_extra;
+
+    if(memtupcount < 10000 || state->input_count < 10000 || !state->estimating)
+        return false;
+
+    double abbr_card = estimateHyperLogLog(&state->abbr_card);
+
+    /* the keys are distinct enough, so stop paying for the estimation */
+    if(abbr_card > 100000.0)
+    {
+        state->estimating = false;
+        return false;
+    }
+
+    return abbr_card < state->input_count / 2000.0 + 0.5;
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_sortsupport);
+Datum spectrum_sortsupport(PG_FUNCTION_ARGS)
+{
+    SortSupport ssup = (SortSupport) PG_GETARG_POINTER(0);
+
+    ssup->comparator = spectrum_fastcmp;
+
+    if(ssup->abbreviate)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(ssup->ssup_cxt);
+
+        SpectrumSortSupport *state = palloc(sizeof(SpectrumSortSupport));
+        state->estimating = true;
+        state->input_count = 0;
+        initHyperLogLog(&state->abbr_card, 10);
+
+        ssup->ssup_extra = state;
+        ssup->comparator = spectrum_abbrev_cmp;
+        ssup->abbrev_converter = spectrum_abbrev_convert;
+        ssup->abbrev_abort = spectrum_abbrev_abort;
+        ssup->abbrev_full_comparator = spectrum_fastcmp;
+
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    PG_RETURN_VOID();
 }
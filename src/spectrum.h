@@ -22,6 +22,58 @@
 #define SRC_SPECTRUM_H_
 
 #include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include "simd.h"
+
+
+/*
+ * Spectra are stored in one of the following formats:
+ *
+ * SPECTRUM_RAW      - the original headerless format: all m/z values followed by all intensities, both as float4
+ * SPECTRUM_FLOAT    - SpectrumHeader followed by the same arrays as in SPECTRUM_RAW (the default format)
+ * SPECTRUM_COMPACT  - SpectrumHeader followed by delta-coded fixed-point m/z values (uint32) and intensities
+ *                     quantized relative to the maximal intensity (uint16); both arrays are byte-shuffled, i.e.
+ *                     the n-th bytes of all values are stored together, which makes them well compressible
+ *
+ * Formats with a header are recognized by the magic value stored in place of the first m/z value. Together with any
+ * format in its lowest byte, it is a signaling NaN (all exponent bits set, the quiet bit cleared and a non-zero
+ * payload). The text input produces only quiet NaN values, and the binary input rejects NaN m/z values.
+ *
+ * The header holds statistics used by the similarity kernels to skip norm computations and to reject pairs of
+ * spectra with non-overlapping m/z ranges early. The norm is computed for the default powers (mz_power = 0 and
+ * intensity_power = 1).
+ */
+#define SPECTRUM_MAGIC              0xFFA54D00
+#define SPECTRUM_MAGIC_MASK         0xFFFFFF00
+
+#define SPECTRUM_MZ_RESOLUTION      1e-5
+#define SPECTRUM_INTENSITY_LEVELS   65535
+#define SPECTRUM_TOP_PEAKS          4
+
+
+typedef enum
+{
+    SPECTRUM_RAW = 0,
+    SPECTRUM_FLOAT = 1,
+    SPECTRUM_COMPACT = 2
+}
+SpectrumFormat;
+
+
+typedef struct
+{
+    uint32 magic;
+    int32 count;
+    float4 mz_min;
+    float4 mz_max;
+    float4 intensity_max;
+    float4 norm;
+    float4 top_mz[SPECTRUM_TOP_PEAKS];
+    float4 top_intensity[SPECTRUM_TOP_PEAKS];
+}
+SpectrumHeader;
 
 
 typedef struct
@@ -32,6 +84,193 @@ typedef struct
 SpectrumPeak;
 
 
+/*
+ * Read-only view of a detoasted spectrum value. Intensities can be accessed randomly, while m/z values have to be
+ * read sequentially by SpectrumCursor because of the delta coding used by the compact format.
+ */
+typedef struct
+{
+    SpectrumFormat format;
+    int count;
+    const SpectrumHeader *header;
+    const float4 *mz;
+    const float4 *intensity;
+    const uint8 *mz_planes;
+    const uint8 *intensity_planes;
+    float4 intensity_scale;
+}
+Spectrum;
+
+
+typedef struct
+{
+    const Spectrum *spectrum;
+    int index;
+    uint32 fixed;
+    float4 mz;
+}
+SpectrumCursor;
+
+
+static inline void spectrum_open(Spectrum *spectrum, const void *value)
+{
+    size_t size = VARSIZE(value) - VARHDRSZ;
+    const SpectrumHeader *header = (const SpectrumHeader *) VARDATA(value);
+
+    memset(spectrum, 0, sizeof(Spectrum));
+
+    if(size >= sizeof(SpectrumHeader) && (header->magic & SPECTRUM_MAGIC_MASK) == SPECTRUM_MAGIC)
+    {
+        spectrum->format = header->magic & ~SPECTRUM_MAGIC_MASK;
+        spectrum->header = header;
+        spectrum->count = header->count;
+
+        if(spectrum->format == SPECTRUM_FLOAT)
+        {
+            if(unlikely(size != sizeof(SpectrumHeader) + 2 * spectrum->count * sizeof(float4)))
+                elog(ERROR, "corrupted spectrum value");
+
+            spectrum->mz = (const float4 *) (header + 1);
+            spectrum->intensity = spectrum->mz + spectrum->count;
+        }
+        else if(spectrum->format == SPECTRUM_COMPACT)
+        {
+            if(unlikely(size != sizeof(SpectrumHeader) + spectrum->count * (sizeof(uint32) + sizeof(uint16))))
+                elog(ERROR, "corrupted spectrum value");
+
+            spectrum->mz_planes = (const uint8 *) (header + 1);
+            spectrum->intensity_planes = spectrum->mz_planes + spectrum->count * sizeof(uint32);
+            spectrum->intensity_scale = header->intensity_max / SPECTRUM_INTENSITY_LEVELS;
+        }
+        else
+        {
+            elog(ERROR, "unsupported spectrum format %i", spectrum->format);
+        }
+    }
+    else
+    {
+        spectrum->format = SPECTRUM_RAW;
+        spectrum->count = size / sizeof(float4) / 2;
+        spectrum->mz = (const float4 *) VARDATA(value);
+        spectrum->intensity = spectrum->mz + spectrum->count;
+    }
+}
+
+
+static inline float4 spectrum_intensity(const Spectrum *spectrum, int index)
+{
+    if(likely(spectrum->intensity != NULL))
+        return spectrum->intensity[index];
+
+    const uint8 *planes = spectrum->intensity_planes;
+    uint16 level = planes[index] | planes[spectrum->count + index] << 8;
+
+    return level * spectrum->intensity_scale;
+}
+
+
+static inline void spectrum_cursor_load(SpectrumCursor *cursor)
+{
+    const Spectrum *spectrum = cursor->spectrum;
+    int index = cursor->index;
+
+    if(unlikely(index >= spectrum->count))
+        return;
+
+    if(likely(spectrum->mz != NULL))
+    {
+        cursor->mz = spectrum->mz[index];
+    }
+    else
+    {
+        const uint8 *planes = spectrum->mz_planes;
+        int count = spectrum->count;
+
+        cursor->fixed += (uint32) planes[index] | (uint32) planes[count + index] << 8 |
+                (uint32) planes[2 * count + index] << 16 | (uint32) planes[3 * count + index] << 24;
+        cursor->mz = cursor->fixed * SPECTRUM_MZ_RESOLUTION;
+    }
+}
+
+
+static inline void spectrum_cursor_init(SpectrumCursor *cursor, const Spectrum *spectrum)
+{
+    cursor->spectrum = spectrum;
+    cursor->index = 0;
+    cursor->fixed = 0;
+    cursor->mz = 0;
+    spectrum_cursor_load(cursor);
+}
+
+
+static inline bool spectrum_cursor_valid(const SpectrumCursor *cursor)
+{
+    return cursor->index < cursor->spectrum->count;
+}
+
+
+static inline void spectrum_cursor_next(SpectrumCursor *cursor)
+{
+    cursor->index++;
+    spectrum_cursor_load(cursor);
+}
+
+
+/*
+ * Advances the cursor to the first peak with the m/z value not lower than the bound.
+ */
+static inline void spectrum_cursor_skip(SpectrumCursor *cursor, float4 bound)
+{
+    const Spectrum *spectrum = cursor->spectrum;
+
+    if(!spectrum_cursor_valid(cursor) || !(cursor->mz < bound))
+        return;
+
+    if(spectrum->mz != NULL)
+    {
+        cursor->index = simd.skip_below(spectrum->mz, cursor->index + 1, spectrum->count, bound);
+        spectrum_cursor_load(cursor);
+    }
+    else
+    {
+        do
+            spectrum_cursor_next(cursor);
+        while(spectrum_cursor_valid(cursor) && cursor->mz < bound);
+    }
+}
+
+
+static inline float4 spectrum_mz_min(const Spectrum *spectrum)
+{
+    return spectrum->header ? spectrum->header->mz_min : spectrum->mz[0];
+}
+
+
+static inline float4 spectrum_mz_max(const Spectrum *spectrum)
+{
+    return spectrum->header ? spectrum->header->mz_max : spectrum->mz[spectrum->count - 1];
+}
+
+
+/*
+ * Returns true if no peak of the second spectrum can fall into the tolerance window of a peak of the first spectrum.
+ * The bounds are computed in the same way as the windows of the kernels, so the result is exact.
+ */
+static inline bool spectrum_disjoint(const Spectrum *spectrum1, const Spectrum *spectrum2, float4 tolerance)
+{
+    if(spectrum1->count == 0 || spectrum2->count == 0)
+        return true;
+
+    return spectrum_mz_max(spectrum1) + tolerance < spectrum_mz_min(spectrum2) ||
+            spectrum_mz_min(spectrum1) - tolerance > spectrum_mz_max(spectrum2);
+}
+
+
+/*
+ * Detoasts only the part of the value needed to read its m/z values. Intensities are not available in the view.
+ */
+void *spectrum_detoast_mz(Datum datum, Spectrum *spectrum);
+
 Datum create_spectrum(SpectrumPeak *data, int count);
 
 #endif /* SRC_SPECTRUM_H_ */
@@ -0,0 +1,554 @@
+/*
+ * This file is part of the PGMS PostgreSQL extension distribution
+ * available at https://bioinfo.uochb.cas.cz/gitlab/chemdb/pgms.
+ *
+ * Copyright (c) 2023 Jakub Galgonek
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <postgres.h>
+#if PG_VERSION_NUM >= 160000
+#include <varatt.h>
+#endif
+#include <fmgr.h>
+#include <math.h>
+#include <access/htup_details.h>
+#include <catalog/pg_statistic.h>
+#include <catalog/pg_type.h>
+#include <commands/vacuum.h>
+#include <nodes/nodeFuncs.h>
+#include <nodes/supportnodes.h>
+#include <optimizer/optimizer.h>
+#include <utils/datum.h>
+#include <utils/lsyscache.h>
+#include <utils/selfuncs.h>
+#include "pgms.h"
+#include "spectrum.h"
+
+
+/*
+ * Statistics kinds collected for spectrum columns, the numbers are taken from the range reserved for private use:
+ *
+ * PGMS_STAKIND_PEAK_COUNT  - stanumbers[0] holds the average number of peaks of non-null spectra
+ * PGMS_STAKIND_MZ_RANGE    - stanumbers holds MZ_RANGE_BINS + 1 quantiles of the lowest m/z values of non-empty
+ *                            spectra followed by MZ_RANGE_BINS + 1 quantiles of their highest m/z values
+ * PGMS_STAKIND_SAMPLE      - stavalues holds a random sample of spectra, the selectivity of similarity predicates is
+ *                            estimated by evaluating them on the sample
+ */
+#define PGMS_STAKIND_PEAK_COUNT     10501
+#define PGMS_STAKIND_MZ_RANGE       10502
+#define PGMS_STAKIND_SAMPLE         10503
+
+#define MZ_RANGE_BINS               20
+#define SAMPLE_SIZE                 100
+
+/* costs of similarity functions in multiples of cpu_operator_cost */
+#define CALL_COST                   10.0
+#define DEFAULT_PEAK_COUNT          100.0
+#define DEFAULT_TOLERANCE           0.1
+
+#define DEFAULT_SIMILARITY_SEL      0.001
+
+
+typedef struct
+{
+    const char *name;
+    double linear;          /* cost per peak of both spectra */
+    double quadratic;       /* cost per pair of peaks */
+    bool shifted;           /* peaks can be matched outside of the m/z range of the other spectrum */
+    bool implicit;          /* the tolerance is given by pgms.similarity_tolerance */
+}
+KernelCost;
+
+
+typedef struct
+{
+    bool known;
+    double peaks;
+    bool constant;
+    float4 mz_min;
+    float4 mz_max;
+    float4 *mz_min_quantiles;
+    float4 *mz_max_quantiles;
+}
+ArgumentStats;
+
+
+static const KernelCost kernel_costs[] =
+{
+    { "cosine_greedy", 2.0, 0.0, false, false },
+    { "cosine_greedy_matchms", 2.0, 0.1, false, false },
+    { "cosine_hungarian", 2.0, 0.5, false, false },
+    { "cosine_modified", 4.0, 0.0, true, false },
+    { "cosine_modified_hungarian", 4.0, 0.5, true, false },
+    { "cosine_greedy_above", 1.0, 0.0, false, false },
+    { "cosine_hungarian_above", 2.0, 0.1, false, false },
+    { "cosine_modified_above", 2.0, 0.0, true, false },
+    { "entropy_similarity", 4.0, 0.0, false, false },
+    { "intersect_mz", 1.0, 0.0, false, false },
+    { "similarity", 4.0, 0.5, true, false },
+    { "spectrum_similar", 2.0, 0.0, false, true },
+    { "spectrum_overlaps", 1.0, 0.0, false, true },
+    { "spectrum_distance", 2.0, 0.0, false, true }
+};
+
+
+static int float4_cmp(const void *l, const void *r)
+{
+    float4 left = *(const float4 *) l;
+    float4 right = *(const float4 *) r;
+
+    return left < right ? -1 : left > right ? 1 : 0;
+}
+
+
+static void spectrum_compute_stats(VacAttrStats *stats, AnalyzeAttrFetchFunc fetchfunc, int samplerows,
+        double totalrows)
+{
+    float4 *mz_min = palloc(samplerows * sizeof(float4));
+    float4 *mz_max = palloc(samplerows * sizeof(float4));
+    Datum *sample = MemoryContextAlloc(stats->anl_context, Min(samplerows, SAMPLE_SIZE) * sizeof(Datum));
+    int stride = Max(samplerows / SAMPLE_SIZE, 1);
+    int nonnull = 0;
+    int ranges = 0;
+    int sampled = 0;
+    double width = 0;
+    double peaks = 0;
+
+    for(int i = 0; i < samplerows; i++)
+    {
+#if PG_VERSION_NUM >= 180000
+        vacuum_delay_point(true);
+#else
+        vacuum_delay_point();
+#endif
+
+        bool isnull;
+        Datum value = fetchfunc(stats, i, &isnull);
+
+        if(isnull)
+            continue;
+
+        nonnull++;
+        width += VARSIZE_ANY(DatumGetPointer(value));
+
+        Spectrum spectrum;
+        void *spec = spectrum_detoast_mz(value, &spectrum);
+
+        peaks += spectrum.count;
+
+        if(spectrum.count > 0)
+        {
+            mz_min[ranges] = spectrum_mz_min(&spectrum);
+            mz_max[ranges] = spectrum_mz_max(&spectrum);
+            ranges++;
+        }
+
+        if(spec != DatumGetPointer(value))
+            pfree(spec);
+
+        /* rows of the sample are ordered physically, so the stride spreads the values over the whole table */
+        if(i % stride == 0 && sampled < SAMPLE_SIZE)
+        {
+            Datum copy = PointerGetDatum(PG_DETOAST_DATUM(value));
+            MemoryContext old_context = MemoryContextSwitchTo(stats->anl_context);
+            sample[sampled++] = datumCopy(copy, false, -1);
+            MemoryContextSwitchTo(old_context);
+        }
+    }
+
+    stats->stats_valid = true;
+    stats->stanullfrac = samplerows > 0 ? (double) (samplerows - nonnull) / samplerows : 0;
+    stats->stawidth = nonnull > 0 ? width / nonnull : 0;
+    stats->stadistinct = 0;
+
+    if(nonnull == 0)
+        return;
+
+    MemoryContext old_context = MemoryContextSwitchTo(stats->anl_context);
+    int slot = 0;
+
+    stats->stakind[slot] = PGMS_STAKIND_PEAK_COUNT;
+    stats->stanumbers[slot] = palloc(sizeof(float4));
+    stats->stanumbers[slot][0] = peaks / nonnull;
+    stats->numnumbers[slot] = 1;
+    slot++;
+
+    if(ranges > 0)
+    {
+        qsort(mz_min, ranges, sizeof(float4), float4_cmp);
+        qsort(mz_max, ranges, sizeof(float4), float4_cmp);
+
+        float4 *numbers = palloc(2 * (MZ_RANGE_BINS + 1) * sizeof(float4));
+
+        for(int i = 0; i <= MZ_RANGE_BINS; i++)
+        {
+            int position = (int) ((int64) (ranges - 1) * i / MZ_RANGE_BINS);
+
+            numbers[i] = mz_min[position];
+            numbers[MZ_RANGE_BINS + 1 + i] = mz_max[position];
+        }
+
+        stats->stakind[slot] = PGMS_STAKIND_MZ_RANGE;
+        stats->stanumbers[slot] = numbers;
+        stats->numnumbers[slot] = 2 * (MZ_RANGE_BINS + 1);
+        slot++;
+    }
+
+    if(sampled > 0)
+    {
+        stats->stakind[slot] = PGMS_STAKIND_SAMPLE;
+        stats->stavalues[slot] = sample;
+        stats->numvalues[slot] = sampled;
+        slot++;
+    }
+
+    MemoryContextSwitchTo(old_context);
+
+    pfree(mz_min);
+    pfree(mz_max);
+}
+
+
+PG_FUNCTION_INFO_V1(spectrum_typanalyze);
+Datum spectrum_typanalyze(PG_FUNCTION_ARGS)
+{
+    VacAttrStats *stats = (VacAttrStats *) PG_GETARG_POINTER(0);
+
+    stats->compute_stats = spectrum_compute_stats;
+    stats->minrows = 300 * default_statistics_target;
+
+    PG_RETURN_BOOL(true);
+}
+
+
+/*
+ * Returns the fraction of values lower than the given one, the distribution is given by its quantiles.
+ */
+static double quantile_fraction(const float4 *quantiles, double value)
+{
+    if(value <= quantiles[0])
+        return 0;
+
+    if(value > quantiles[MZ_RANGE_BINS])
+        return 1;
+
+    int i = 0;
+
+    while(value > quantiles[i + 1])
+        i++;
+
+    double width = quantiles[i + 1] - quantiles[i];
+    double part = width > 0 ? (value - quantiles[i]) / width : 0;
+
+    return (i + part) / MZ_RANGE_BINS;
+}
+
+
+static void argument_stats(PlannerInfo *root, Node *arg, ArgumentStats *stats)
+{
+    memset(stats, 0, sizeof(ArgumentStats));
+
+    if(root != NULL)
+        arg = estimate_expression_value(root, arg);
+
+    if(IsA(arg, Const))
+    {
+        Const *constant = (Const *) arg;
+
+        if(constant->constisnull)
+            return;
+
+        Spectrum spectrum;
+        void *spec = spectrum_detoast_mz(constant->constvalue, &spectrum);
+
+        stats->known = true;
+        stats->constant = true;
+        stats->peaks = spectrum.count;
+
+        if(spectrum.count > 0)
+        {
+            stats->mz_min = spectrum_mz_min(&spectrum);
+            stats->mz_max = spectrum_mz_max(&spectrum);
+        }
+
+        if(spec != DatumGetPointer(constant->constvalue))
+            pfree(spec);
+
+        return;
+    }
+
+    if(root == NULL)
+        return;
+
+    VariableStatData vardata;
+    AttStatsSlot sslot;
+
+    examine_variable(root, arg, 0, &vardata);
+
+    if(HeapTupleIsValid(vardata.statsTuple))
+    {
+        if(get_attstatsslot(&sslot, vardata.statsTuple, PGMS_STAKIND_PEAK_COUNT, InvalidOid, ATTSTATSSLOT_NUMBERS))
+        {
+            if(sslot.nnumbers > 0)
+            {
+                stats->known = true;
+                stats->peaks = sslot.numbers[0];
+            }
+
+            free_attstatsslot(&sslot);
+        }
+
+        if(get_attstatsslot(&sslot, vardata.statsTuple, PGMS_STAKIND_MZ_RANGE, InvalidOid, ATTSTATSSLOT_NUMBERS))
+        {
+            if(sslot.nnumbers == 2 * (MZ_RANGE_BINS + 1))
+            {
+                stats->mz_min_quantiles = palloc(2 * (MZ_RANGE_BINS + 1) * sizeof(float4));
+                memcpy(stats->mz_min_quantiles, sslot.numbers, 2 * (MZ_RANGE_BINS + 1) * sizeof(float4));
+                stats->mz_max_quantiles = stats->mz_min_quantiles + MZ_RANGE_BINS + 1;
+            }
+
+            free_attstatsslot(&sslot);
+        }
+    }
+
+    ReleaseVariableStats(vardata);
+}
+
+
+/*
+ * Estimates the fraction of calls that do not end by the early rejection of spectra with disjoint m/z ranges. It is
+ * known only if one of the spectra is constant and the m/z ranges of the other one were collected by ANALYZE.
+ */
+static double overlap_fraction(const ArgumentStats *constant, const ArgumentStats *column, double tolerance)
+{
+    if(!constant->constant || column->mz_min_quantiles == NULL)
+        return 1;
+
+    if(constant->peaks == 0)
+        return 0;
+
+    double below = quantile_fraction(column->mz_max_quantiles, constant->mz_min - tolerance);
+    double above = 1 - quantile_fraction(column->mz_min_quantiles, constant->mz_max + tolerance);
+
+    return Max(1 - below - above, 0);
+}
+
+
+static void similarity_cost(PlannerInfo *root, Oid funcid, List *args, Cost *per_tuple)
+{
+    char *name = get_func_name(funcid);
+    const KernelCost *kernel = NULL;
+
+    for(int i = 0; i < lengthof(kernel_costs); i++)
+        if(name != NULL && strcmp(name, kernel_costs[i].name) == 0)
+            kernel = &kernel_costs[i];
+
+    if(kernel == NULL || list_length(args) < 2)
+        return;
+
+    ArgumentStats stats1;
+    ArgumentStats stats2;
+
+    argument_stats(root, (Node *) linitial(args), &stats1);
+    argument_stats(root, (Node *) lsecond(args), &stats2);
+
+    if(!stats1.known && !stats2.known)
+        return;
+
+    double peaks1 = stats1.known ? stats1.peaks : DEFAULT_PEAK_COUNT;
+    double peaks2 = stats2.known ? stats2.peaks : DEFAULT_PEAK_COUNT;
+    double tolerance = DEFAULT_TOLERANCE;
+
+    if(kernel->implicit)
+        tolerance = similarity_tolerance;
+    else if(list_length(args) > 2 && IsA(lthird(args), Const) && !((Const *) lthird(args))->constisnull)
+        tolerance = fabs(DatumGetFloat4(((Const *) lthird(args))->constvalue));
+
+    double overlap = 1;
+
+    if(!kernel->shifted)
+        overlap = Min(overlap_fraction(&stats1, &stats2, tolerance), overlap_fraction(&stats2, &stats1, tolerance));
+
+    double cost = kernel->linear * (peaks1 + peaks2) + kernel->quadratic * peaks1 * peaks2;
+
+    *per_tuple = cpu_operator_cost * (CALL_COST + overlap * cost);
+}
+
+
+/*
+ * Estimates the selectivity of a boolean similarity predicate by evaluating it on the sample of spectra collected by
+ * ANALYZE. One of the arguments has to be a column, the other ones have to be constants. Returns a negative value if
+ * the selectivity cannot be estimated in this way.
+ */
+static double sample_selectivity(PlannerInfo *root, Oid funcid, List *args, int varRelid)
+{
+    int nargs = list_length(args);
+    Datum *values = palloc(nargs * sizeof(Datum));
+    Node *column = NULL;
+    int position = -1;
+    int i = 0;
+    ListCell *cell;
+
+    foreach(cell, args)
+    {
+        Node *arg = estimate_expression_value(root, (Node *) lfirst(cell));
+
+        if(IsA(arg, Const))
+        {
+            /* functions are strict */
+            if(((Const *) arg)->constisnull)
+                return 0;
+
+            values[i] = ((Const *) arg)->constvalue;
+        }
+        else if(column == NULL)
+        {
+            column = arg;
+            position = i;
+        }
+        else
+        {
+            return -1;
+        }
+
+        i++;
+    }
+
+    if(column == NULL)
+        return -1;
+
+    VariableStatData vardata;
+    AttStatsSlot sslot;
+    double selectivity = -1;
+
+    examine_variable(root, column, varRelid, &vardata);
+
+    if(HeapTupleIsValid(vardata.statsTuple) && statistic_proc_security_check(&vardata, funcid) &&
+            get_attstatsslot(&sslot, vardata.statsTuple, PGMS_STAKIND_SAMPLE, InvalidOid, ATTSTATSSLOT_VALUES))
+    {
+        double nullfrac = ((Form_pg_statistic) GETSTRUCT(vardata.statsTuple))->stanullfrac;
+        FmgrInfo flinfo;
+        int matches = 0;
+
+        fmgr_info(funcid, &flinfo);
+
+        LOCAL_FCINFO(fcinfo, FUNC_MAX_ARGS);
+        InitFunctionCallInfoData(*fcinfo, &flinfo, nargs, InvalidOid, NULL, NULL);
+
+        for(int j = 0; j < nargs; j++)
+        {
+            fcinfo->args[j].value = values[j];
+            fcinfo->args[j].isnull = false;
+        }
+
+        for(int j = 0; j < sslot.nvalues; j++)
+        {
+            fcinfo->args[position].value = sslot.values[j];
+            fcinfo->isnull = false;
+
+            Datum result = FunctionCallInvoke(fcinfo);
+
+            if(!fcinfo->isnull && DatumGetBool(result))
+                matches++;
+        }
+
+        /* a predicate not matching the sample still matches something, like rare values in eqsel() */
+        if(sslot.nvalues > 0)
+            selectivity = Max(matches, 0.5) / sslot.nvalues * (1 - nullfrac);
+
+        free_attstatsslot(&sslot);
+    }
+
+    ReleaseVariableStats(vardata);
+
+    if(selectivity >= 0)
+        CLAMP_PROBABILITY(selectivity);
+
+    return selectivity;
+}
+
+
+/*
+ * Planner support function of similarity functions. The cost of a call is derived from the number of peaks of the
+ * compared spectra and from the chance of early rejection of spectra with disjoint m/z ranges, the selectivity of
+ * boolean predicates is estimated from the sample of spectra.
+ */
+PG_FUNCTION_INFO_V1(spectrum_similarity_support);
+Datum spectrum_similarity_support(PG_FUNCTION_ARGS)
+{
+    Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+
+    if(IsA(rawreq, SupportRequestCost))
+    {
+        SupportRequestCost *req = (SupportRequestCost *) rawreq;
+        List *args;
+
+        if(req->node != NULL && is_funcclause(req->node))
+            args = ((FuncExpr *) req->node)->args;
+        else if(req->node != NULL && is_opclause(req->node))
+            args = ((OpExpr *) req->node)->args;
+        else
+            PG_RETURN_POINTER(NULL);
+
+        Cost per_tuple = -1;
+        similarity_cost(req->root, req->funcid, args, &per_tuple);
+
+        if(per_tuple < 0)
+            PG_RETURN_POINTER(NULL);
+
+        req->startup = 0;
+        req->per_tuple = per_tuple;
+
+        PG_RETURN_POINTER(req);
+    }
+    else if(IsA(rawreq, SupportRequestSelectivity))
+    {
+        SupportRequestSelectivity *req = (SupportRequestSelectivity *) rawreq;
+
+        if(req->is_join || get_func_rettype(req->funcid) != BOOLOID)
+            PG_RETURN_POINTER(NULL);
+
+        double selectivity = sample_selectivity(req->root, req->funcid, req->args, req->varRelid);
+
+        if(selectivity < 0)
+            PG_RETURN_POINTER(NULL);
+
+        req->selectivity = selectivity;
+
+        PG_RETURN_POINTER(req);
+    }
+
+    PG_RETURN_POINTER(NULL);
+}
+
+
+/*
+ * Restriction selectivity estimator of the similarity operators.
+ */
+PG_FUNCTION_INFO_V1(spectrum_similarity_sel);
+Datum spectrum_similarity_sel(PG_FUNCTION_ARGS)
+{
+    PlannerInfo *root = (PlannerInfo *) PG_GETARG_POINTER(0);
+    Oid operator = PG_GETARG_OID(1);
+    List *args = (List *) PG_GETARG_POINTER(2);
+    int varRelid = PG_GETARG_INT32(3);
+
+    double selectivity = sample_selectivity(root, get_opcode(operator), args, varRelid);
+
+    if(selectivity < 0)
+        selectivity = DEFAULT_SIMILARITY_SEL;
+
+    PG_RETURN_FLOAT8(selectivity);
+}